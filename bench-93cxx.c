@@ -0,0 +1,307 @@
+/*
+ * bench-93cxx - throughput benchmark for eeprom-93cxx
+ *
+ * Copyright (C) 2016 Alexandru Gagniuc <mr.nuke.me@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * The benchmark drives the same code paths as the programmer, so it is built
+ * from the same source, with the programmer's main() left out.
+ */
+#define EEPROM_93CXX_NO_MAIN
+#include "eeprom-93cxx.c"
+
+enum bench_path {
+	BENCH_WORD_READ,
+	BENCH_BATCH_READ,
+	BENCH_BURST_READ,
+	BENCH_WRITE,
+	BENCH_ERASE,
+	BENCH_NR_PATHS,
+};
+
+static const char *const bench_path_names[BENCH_NR_PATHS] = {
+	[BENCH_WORD_READ] = "word-read",
+	[BENCH_BATCH_READ] = "batch-read",
+	[BENCH_BURST_READ] = "burst-read",
+	[BENCH_WRITE] = "write",
+	[BENCH_ERASE] = "erase",
+};
+
+struct bench_cfg {
+	const char *spidev;
+	const char *type;
+	uint32_t speed_hz;
+	uint32_t twc_us;
+	unsigned int iterations;
+	bool destructive;
+};
+
+/* Read the array one word, and one SPI message, at a time. */
+static int bench_word_read(const struct eeprom *eeprom, uint8_t *buf)
+{
+	const size_t step = eeprom->is_x16 ? 2 : 1;
+	size_t i;
+
+	for (i = 0; i < eeprom->size; i += step) {
+		if (read_words(eeprom, buf + i, i / step, 1) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int bench_erase(const struct eeprom *eeprom)
+{
+	if (enable_write(eeprom) < 0 || erase_all(eeprom) < 0)
+		return -1;
+
+	return wait_bulk_cycle(eeprom);
+}
+
+static int bench_run_path(const struct eeprom *eeprom, enum bench_path path,
+			  struct xfer_plan *plan, uint8_t *buf)
+{
+	const size_t step = eeprom->is_x16 ? 2 : 1;
+
+	switch (path) {
+	case BENCH_WORD_READ:
+		return bench_word_read(eeprom, buf);
+	case BENCH_BATCH_READ:
+		return read_words(eeprom, buf, 0, eeprom->size / step);
+	case BENCH_BURST_READ:
+		return read_sequential(eeprom, buf, 0, eeprom->size / step);
+	case BENCH_WRITE:
+		if (enable_write(eeprom) < 0)
+			return -1;
+		return eeprom_program_array(eeprom, plan, NULL, false) ==
+		       EXIT_SUCCESS ? 0 : -1;
+	case BENCH_ERASE:
+		return bench_erase(eeprom);
+	default:
+		return -1;
+	}
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Run 'path' on one geometry, and print a line of results. */
+static int bench_geometry(const struct bench_cfg *bench,
+			  const struct eeprom *type, bool x16,
+			  enum bench_path path)
+{
+	struct eeprom eeprom = *type;
+	struct eeprom_stats stats = {0};
+	struct eeprom_cfg config = { .eeprom = &eeprom };
+	struct xfer_plan plan = { 0 };
+	struct eeprom_image image = { 0 };
+	const struct stats_hist *msgs;
+	uint64_t *samples, start, total_us = 0, nr_msgs = 0;
+	uint8_t *buf;
+	unsigned int i, op;
+	int ret = 0;
+
+	eeprom.is_x16 = x16;
+	if (x16)
+		eeprom.addr_bits--;
+	eeprom.speed_hz = bench->speed_hz;
+	eeprom.wait = wait_strategy_find("backoff");
+	if (bench->twc_us) {
+		eeprom.twc_typ_us = bench->twc_us;
+		eeprom.twc_max_us = bench->twc_us;
+	}
+
+	if (sanitize_input(&config) < 0)
+		return -1;
+
+	buf = malloc(eeprom.size);
+	samples = calloc(bench->iterations, sizeof(*samples));
+	if (!buf || !samples) {
+		perror("Could not allocate benchmark buffers");
+		free(buf);
+		free(samples);
+		return -1;
+	}
+
+	/* Something other than the erased state, so writes aren't no-ops. */
+	for (i = 0; i < eeprom.size; i++)
+		buf[i] = i * 7;
+
+	if (eeprom_open(&eeprom, bench->spidev) < 0) {
+		perror("Could not open SPI device");
+		free(buf);
+		free(samples);
+		return -1;
+	}
+
+	/* The plan is built once, and rerun for every iteration. */
+	image.data = buf;
+	if (path == BENCH_WRITE && plan_write(&eeprom, &plan, &image) < 0) {
+		perror("Could not allocate write plan");
+		eeprom_close(&eeprom);
+		free(buf);
+		free(samples);
+		return -1;
+	}
+
+	/* Only account the benchmarked path, not the setup above. */
+	eeprom.stats = &stats;
+
+	for (i = 0; i < bench->iterations; i++) {
+		start = now_us();
+		if (bench_run_path(&eeprom, path, &plan, buf) < 0) {
+			perror("Benchmark transaction failed");
+			ret = -1;
+			break;
+		}
+		samples[i] = now_us() - start;
+		total_us += samples[i];
+	}
+
+	if (eeprom_close(&eeprom) < 0) {
+		perror("Could not close SPI device");
+		ret = -1;
+	}
+	plan_free(&plan);
+
+	if (!ret) {
+		for (op = 0; op < STATS_NR_OPS; op++)
+			nr_msgs += stats.ioctl_us[op].count;
+
+		msgs = &stats.ioctl_us[path == BENCH_WRITE ? STATS_WRITE :
+				       path == BENCH_ERASE ? STATS_COMMAND :
+				       STATS_READ];
+
+		qsort(samples, bench->iterations, sizeof(*samples),
+		      compare_u64);
+
+		printf("%-6s %-4s %-11s %12.0f %8.1f %8llu %8llu %9.3f %9.3f\n",
+		       eeprom.name, x16 ? "x16" : "x8", bench_path_names[path],
+		       total_us ? (double)eeprom.size * bench->iterations *
+				  1e6 / total_us : 0.0,
+		       (double)nr_msgs / bench->iterations,
+		       (unsigned long long)hist_percentile(msgs, 50),
+		       (unsigned long long)hist_percentile(msgs, 99),
+		       samples[(bench->iterations - 1) / 2] / 1000.0,
+		       samples[(bench->iterations * 99 - 1) / 100] / 1000.0);
+	}
+
+	free(buf);
+	free(samples);
+	return ret;
+}
+
+static const char bench_help[] =
+"  -D, --spi-device <dev> Device to benchmark (default: 'sim')\n"
+"  -t, --eeprom-type    Only benchmark this EEPROM type\n"
+"  -f, --speed <hz>     SPI clock in Hz\n"
+"  -n, --iterations <nr> Times each path is run (default: 10)\n"
+"  --twc <us>           Override the write cycle time of the parts\n"
+"  --destructive        Also benchmark write and erase on real devices\n"
+"  -h, --help           Display this help menu\n";
+
+int main(int argc, char *argv[])
+{
+	const struct eeprom *type;
+	enum bench_path path;
+	int opt, destructive = 0, ret = EXIT_SUCCESS;
+	bool is_sim, x16;
+
+	struct bench_cfg bench = {
+		.spidev = "sim",
+		.speed_hz = SPI_SAFE_SPEED_HZ,
+		.iterations = 10,
+	};
+
+	struct option long_options[] = {
+		{"spi-device",	required_argument,	0, 'D'},
+		{"eeprom-type",	required_argument,	0, 't'},
+		{"speed",	required_argument,	0, 'f'},
+		{"iterations",	required_argument,	0, 'n'},
+		{"twc",		required_argument,	0, 'T'},
+		{"destructive",	no_argument,		&destructive, 1},
+		{"help",	no_argument,		0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc, argv, "D:t:f:n:h", long_options,
+				  NULL)) != EOF) {
+		switch (opt) {
+			case 0:
+				break;
+			case 'D':
+				bench.spidev = optarg;
+				break;
+			case 't':
+				bench.type = optarg;
+				break;
+			case 'f':
+				bench.speed_hz = strtoul(optarg, NULL, 0);
+				break;
+			case 'n':
+				bench.iterations = strtoul(optarg, NULL, 0);
+				break;
+			case 'T':
+				bench.twc_us = strtoul(optarg, NULL, 0);
+				break;
+			case 'h':
+				printf("%s", bench_help);
+				return EXIT_SUCCESS;
+			default:
+				printf("%s", bench_help);
+				return EXIT_FAILURE;
+		}
+	}
+
+	bench.destructive = destructive;
+	if (!bench.speed_hz || !bench.iterations) {
+		fprintf(stderr, "Speed and iterations must be non-zero\n");
+		return EXIT_FAILURE;
+	}
+
+	if (bench.type && !eeprom_find(bench.type)) {
+		fprintf(stderr, "Unknown EEPROM type: %s\n", bench.type);
+		return EXIT_FAILURE;
+	}
+
+	is_sim = !strncmp(bench.spidev, "sim", 3);
+
+	printf("Device: %s, SPI clock: %u Hz, %u iterations\n", bench.spidev,
+	       bench.speed_hz, bench.iterations);
+	printf("%-6s %-4s %-11s %12s %8s %8s %8s %9s %9s\n", "part", "org",
+	       "path", "bytes/s", "msgs/op", "p50_us", "p99_us", "p50_ms",
+	       "p99_ms");
+
+	for (type = eeprom_types_list; type->size; type++) {
+		if (bench.type && strcasecmp(bench.type, type->name))
+			continue;
+
+		for (x16 = false; ; x16 = true) {
+			if (type->flags & (x16 ? EEPROM_X16 : EEPROM_X8)) {
+				for (path = 0; path < BENCH_NR_PATHS; path++) {
+					if (path >= BENCH_WRITE && !is_sim &&
+					    !bench.destructive)
+						continue;
+					if (bench_geometry(&bench, type, x16,
+							   path) < 0)
+						ret = EXIT_FAILURE;
+				}
+			}
+
+			if (x16)
+				break;
+		}
+	}
+
+	return ret;
+}
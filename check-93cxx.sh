@@ -0,0 +1,192 @@
+#!/bin/sh
+#
+# check-93cxx - round trips through eeprom-93cx6, against the simulator
+#
+# Copyright (C) 2016 Alexandru Gagniuc <mr.nuke.me@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Every check runs the programmer on a "sim:<file>" device, and compares the
+# backing file, which holds the simulated array, with what is expected.
+
+PROG=${PROG:-./eeprom-93cx6}
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+# Keep the speed and shadow caches out of the user's home.
+XDG_CACHE_HOME=$TMP/cache
+export XDG_CACHE_HOME
+
+passed=0
+failed=0
+
+pass()
+{
+	passed=$((passed + 1))
+}
+
+fail()
+{
+	echo "FAIL: $*"
+	failed=$((failed + 1))
+}
+
+# run <args>: run the programmer quietly, showing its output on failure.
+run()
+{
+	if ! "$PROG" "$@" > "$TMP/out" 2>&1; then
+		cat "$TMP/out"
+		return 1
+	fi
+}
+
+# random <file> <bytes>
+random()
+{
+	head -c "$2" /dev/urandom > "$1"
+}
+
+# same <what> <expected> <actual>
+same()
+{
+	if cmp -s "$2" "$3"; then
+		pass
+	else
+		fail "$1"
+	fi
+}
+
+# Write, read back, diff write, and erase, for one geometry and options.
+roundtrip()
+{
+	name=$1
+	size=$2
+	shift 2
+	dev=$TMP/dev.bin
+
+	rm -f "$dev"
+	random "$TMP/img" "$size"
+
+	run -D "sim:$dev" "$@" -w "$TMP/img" --verify &&
+		same "$name: write" "$TMP/img" "$dev" || fail "$name: write"
+
+	run -D "sim:$dev" "$@" -r "$TMP/back" &&
+		same "$name: read" "$TMP/img" "$TMP/back" || fail "$name: read"
+
+	run -D "sim:$dev" "$@" --word-read --no-cache -r "$TMP/back" &&
+		same "$name: word read" "$TMP/img" "$TMP/back" ||
+		fail "$name: word read"
+
+	cp "$TMP/img" "$TMP/img2"
+	printf '\125\252' | dd of="$TMP/img2" bs=1 seek=4 conv=notrunc \
+		2> /dev/null
+	run -D "sim:$dev" "$@" -w "$TMP/img2" --diff --verify &&
+		same "$name: diff write" "$TMP/img2" "$dev" ||
+		fail "$name: diff write"
+
+	run -D "sim:$dev" "$@" -e || fail "$name: erase"
+	tr '\000-\377' '\377' < "$TMP/img" > "$TMP/erased"
+	same "$name: erase" "$TMP/erased" "$dev"
+}
+
+for type in 93c46:128 93c56:256 93c66:512; do
+	part=${type%:*}
+	size=${type#*:}
+	roundtrip "$part x8" "$size" -t "$part"
+	roundtrip "$part x16" "$size" -t "$part" --x16
+	roundtrip "$part x16 padded" "$size" -t "$part" --x16 --pad-cmds
+	roundtrip "$part x8 paced" "$size" -t "$part" --wait paced
+	roundtrip "$part x16 paced" "$size" -t "$part" --x16 --wait paced
+done
+
+# Raw reads also go to pipes, which can't be mapped.
+dev=$TMP/pipe.bin
+random "$TMP/img" 256
+cp "$TMP/img" "$dev"
+{
+	"$PROG" -D "sim:$dev" -t 93c56 --no-cache -r /dev/fd/3 3>&1 \
+		> /dev/null 2>&1
+	echo $? > "$TMP/status"
+} | cat > "$TMP/back"
+if [ "$(cat "$TMP/status")" -eq 0 ]; then
+	same "pipe read" "$TMP/img" "$TMP/back"
+else
+	fail "pipe read"
+fi
+
+# Ranges: only the selected bytes change, on writes and erases.
+dev=$TMP/range.bin
+random "$TMP/img" 128
+cp "$TMP/img" "$dev"
+random "$TMP/part" 32
+run -D "sim:$dev" -t 93c46 -w "$TMP/part" --offset 64 --length 32 ||
+	fail "range write"
+{
+	head -c 64 "$TMP/img"
+	cat "$TMP/part"
+	tail -c 32 "$TMP/img"
+} > "$TMP/expect"
+same "range write" "$TMP/expect" "$dev"
+
+run -D "sim:$dev" -t 93c46 -r "$TMP/back" --offset 64 --length 32 &&
+	same "range read" "$TMP/part" "$TMP/back" || fail "range read"
+
+run -D "sim:$dev" -t 93c46 -e --offset 0 --length 16 || fail "range erase"
+{
+	printf '\377\377\377\377\377\377\377\377\377\377\377\377\377\377\377\377'
+	tail -c 112 "$TMP/expect"
+} > "$TMP/expect2"
+same "range erase" "$TMP/expect2" "$dev"
+
+# Diff writes read the device, even when a word changed behind the shadow
+# cache's back, and its fingerprint still matches.
+dev=$TMP/shadow.bin
+random "$TMP/img" 128
+cp "$TMP/img" "$dev"
+run -D "sim:$dev" -t 93c46 -r "$TMP/back" || fail "shadow read"
+printf '\125' | dd of="$dev" bs=1 seek=77 conv=notrunc 2> /dev/null
+run -D "sim:$dev" -t 93c46 -w "$TMP/img" --diff || fail "shadow diff write"
+same "shadow diff write" "$TMP/img" "$dev"
+
+# Templates: each device gets its own counter, and nothing else changes.
+dev=$TMP/tmpl.bin
+random "$TMP/img" 128
+printf 'serial 0x10 2 counter:100\n' > "$TMP/t.tmpl"
+rm -f "$dev"
+run -D "sim:$dev" -t 93c46 -w "$TMP/img" --template "$TMP/t.tmpl" \
+	--index 5 --verify || fail "template write"
+cp "$TMP/img" "$TMP/expect"
+printf '\000\151' | dd of="$TMP/expect" bs=1 seek=16 conv=notrunc 2> /dev/null
+same "template write" "$TMP/expect" "$dev"
+
+# A range image doesn't cover the whole array, so it can't take a template.
+cp "$dev" "$TMP/before"
+if "$PROG" -D "sim:$dev" -t 93c46 -w "$TMP/part" --offset 64 --length 32 \
+	--template "$TMP/t.tmpl" > /dev/null 2>&1; then
+	fail "template range write"
+else
+	same "template range write" "$TMP/before" "$dev"
+fi
+
+# Gang: several devices on one controller, written at once.
+random "$TMP/img" 128
+rm -f "$TMP"/spidev0.*
+run -D "sim:$TMP/spidev0.0,sim:$TMP/spidev0.1,sim:$TMP/spidev0.2" \
+	-t 93c46 -w "$TMP/img" --verify || fail "gang write"
+for i in 0 1 2; do
+	same "gang write $i" "$TMP/img" "$TMP/spidev0.$i"
+done
+
+# Simulated devices aren't globs, and a pattern must not become a file name.
+if "$PROG" -D "sim:$TMP/spidev0.*" -t 93c46 -e > /dev/null 2>&1 ||
+	[ -e "$TMP/spidev0.*" ]; then
+	fail "sim glob"
+else
+	pass
+fi
+
+echo "$passed passed, $failed failed"
+[ "$failed" -eq 0 ]
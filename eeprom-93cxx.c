@@ -9,30 +9,80 @@
  * (at your option) any later version.
  */
 
+#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <glob.h>
+#include <limits.h>
 #include <linux/spi/spidev.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/ioctl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 
 
 #define OPCODE_READ		(0x2)
 #define OPCODE_WRITE		(0x1)
+#define OPCODE_ERASE		(0x3)
 #define OPCODE_EWEN		(0x0)
 #define  SUBCODE_EWEN		(3)
 #define  SUBCODE_ERAL		(2)
+#define  SUBCODE_WRAL		(1)
 #define  SUBCODE_EWDS		(0)
 
+/* Conservative clock, which every 93Cxx part supports at any voltage. */
+#define SPI_SAFE_SPEED_HZ	100000
+
+/* Write cycle times assumed for custom geometries, per common datasheets. */
+#define DEFAULT_TWC_TYP_US	3000
+#define DEFAULT_TWC_MAX_US	10000
+/* Bulk operations (ERAL/WRAL) may take a few times longer than a word. */
+#define BULK_TWC_FACTOR		4
+/* Times mismatching words are rewritten before verification gives up. */
+#define VERIFY_RETRIES		2
+/* Mismatching words listed individually, per verification pass. */
+#define VERIFY_MAP_MAX		16
+/* Most devices driven at once in gang mode. */
+#define GANG_MAX_DEVICES	64
+/* Cost of an ERAL/WRAL, in single word writes, used to decide if it pays. */
+#define BULK_WRITE_COST		BULK_TWC_FACTOR
+/* Most fields in a personalization template. */
+#define TEMPLATE_MAX_FIELDS	32
+/* Margin added to tWC(max) when pacing writes, in 1/8ths of it. */
+#define PACED_TWC_MARGIN	1
+/* Words read back to check that a device still matches its shadow cache. */
+#define SHADOW_SAMPLES		16
+/* Interval between status polls of a busy device, when interleaving writes. */
+#define INTERLEAVE_POLL_US	50
+/* Longest job request accepted by the daemon, in bytes. */
+#define DAEMON_LINE_MAX		(2 * PATH_MAX)
+
+/* spidev's default per-message buffer, used when sysfs doesn't tell us. */
+#define SPIDEV_DEFAULT_BUFSIZ	4096
+#define SPIDEV_BUFSIZ_PATH	"/sys/module/spidev/parameters/bufsiz"
+/* The ioctl size field limits how many transfers fit in one message. */
+#define SPI_MAX_XFERS		(((1 << _IOC_SIZEBITS) - 1) / \
+				 sizeof(struct spi_ioc_transfer))
+
 enum eeprom_action {
 	NONE,
 	EEPROM_READ,
 	EEPROM_ERASE,
 	EEPROM_WRITE,
+	EEPROM_VERIFY,
 };
 
 enum eeprom_flags {
@@ -41,40 +91,259 @@ enum eeprom_flags {
 	EEPROM_ORG	= (EEPROM_X8 | EEPROM_X16)
 };
 
+/* Histogram with log2 buckets: bucket i holds values in [2^(i-1), 2^i). */
+#define STATS_BUCKETS		24
+
+struct stats_hist {
+	uint64_t count;
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[STATS_BUCKETS];
+};
+
+/* Kinds of SPI messages accounted separately. */
+enum stats_op {
+	STATS_READ,
+	STATS_WRITE,
+	STATS_STATUS,
+	STATS_COMMAND,
+	STATS_NR_OPS,
+};
+
+static const char *const stats_op_names[STATS_NR_OPS] = {
+	[STATS_READ] = "read",
+	[STATS_WRITE] = "write",
+	[STATS_STATUS] = "status",
+	[STATS_COMMAND] = "command",
+};
+
+struct eeprom_stats {
+	/* Time spent in each SPI message, in microseconds. */
+	struct stats_hist ioctl_us[STATS_NR_OPS];
+	uint64_t xfers[STATS_NR_OPS];
+	uint64_t bytes[STATS_NR_OPS];
+	/* Time spent waiting for write cycles, and status polls per wait. */
+	struct stats_hist wait_us;
+	struct stats_hist polls;
+};
+
+enum stats_format {
+	STATS_NONE,
+	STATS_TABLE,
+	STATS_JSON,
+};
+
+struct eeprom;
+
+/*
+ * Strategy for waiting out a self-timed write cycle. wait_ready() is called
+ * right after the command which started the cycle, and returns 0 once the
+ * part signals ready, or -1 with errno set to ETIMEDOUT after 'timeout_us'.
+ */
+struct wait_strategy {
+	const char *name;
+	int (*wait_ready)(const struct eeprom *eeprom, uint32_t initial_us,
+			  uint32_t timeout_us);
+	/*
+	 * Word writes are paced by the kernel, with a delay after each one in
+	 * the transfer list, so that a whole batch is one message. The status
+	 * is only checked at the end of the batch.
+	 */
+	bool paced;
+};
+
+/*
+ * Backend which carries SPI messages to the chip. transfer() has the same
+ * semantics, and return value, as the SPI_IOC_MESSAGE ioctl.
+ */
+struct spi_transport {
+	const char *name;
+	int (*open)(struct eeprom *eeprom, const char *path);
+	int (*close)(struct eeprom *eeprom);
+	int (*transfer)(const struct eeprom *eeprom,
+			struct spi_ioc_transfer *xfer, unsigned int nr_xfers);
+	uint32_t (*max_speed_hz)(const struct eeprom *eeprom);
+	/* Whether the controller can shift words of 'bits' bits, if known. */
+	bool (*supports_bits)(const struct eeprom *eeprom, uint8_t bits);
+};
+
 struct eeprom {
 	const char *name;
+	const struct spi_transport *transport;
+	void *priv;
 	int spi_fd;
+	size_t bufsiz;
+	uint32_t speed_hz;
+	uint32_t twc_typ_us;
+	uint32_t twc_max_us;
+	const struct wait_strategy *wait;
+	struct eeprom_stats *stats;
+	/* Set once sequential reads were found not to work on this setup. */
+	bool no_seq_read;
+	/* Always pad command headers to 16 bits, even if not needed. */
+	bool pad_cmds;
+	/*
+	 * Width of command headers, when the controller takes them unpadded,
+	 * or 0. The headers are then looked up in 'exact', in CPU byte order.
+	 */
+	uint8_t hdr_bits;
+	struct cmd_table *exact;
+	/* Plan of whole array reads, built on first use, and freed on close. */
+	struct xfer_plan *read_plan;
 	uint16_t size;
 	uint8_t addr_bits;
 	uint8_t flags;
 	bool is_x16;
 };
 
+/*
+ * An image to write. Only words with their bytes set in 'dirty' are written,
+ * the rest of the array is left untouched.
+ */
+struct eeprom_image {
+	uint8_t *data;
+	/* One flag per byte, or NULL if the image covers the whole array. */
+	uint8_t *dirty;
+	/* 'data' is a mapping of a raw file, rather than allocated. */
+	bool mapped;
+};
+
+/*
+ * A field which differs between devices programmed from the same image. Its
+ * value comes from a counter, a list, or a checksum over a range of the image.
+ */
+enum field_source {
+	FIELD_COUNTER,
+	FIELD_LIST,
+	FIELD_CHECKSUM,
+};
+
+enum checksum_algo {
+	CSUM_SUM8,
+	CSUM_XOR8,
+	CSUM_SUM16,
+	CSUM_CRC16,
+	CSUM_CRC32,
+};
+
+struct template_field {
+	char name[32];
+	size_t offset;
+	size_t width;
+	bool little_endian;
+	enum field_source source;
+	/* Counter: 'start' for the first device, then 'step' more each. */
+	uint64_t start;
+	uint64_t step;
+	/* List: one value per device. */
+	uint64_t *list;
+	size_t list_len;
+	/* Checksum of bytes 'range_start' to 'range_end', inclusive. */
+	enum checksum_algo algo;
+	size_t range_start;
+	size_t range_end;
+	/* For sums, make the range, field included, add up to 'target'. */
+	bool has_target;
+	uint64_t target;
+};
+
+struct template {
+	struct template_field fields[TEMPLATE_MAX_FIELDS];
+	size_t nr_fields;
+};
+
+/*
+ * A file format for images. Formats without callbacks are raw, with the file
+ * mapped as is. Others are parsed into, and formatted from, a buffer.
+ */
+struct image_format {
+	const char *name;
+	/* File name extensions recognized as this format. */
+	const char *extensions;
+	int (*load)(const struct eeprom *eeprom, FILE *in, const char *path,
+		    struct eeprom_image *img);
+	/* Save bytes 'offset' to 'offset + length - 1' of the array 'data'. */
+	int (*save)(const struct eeprom *eeprom, FILE *out,
+		    const uint8_t *data, size_t offset, size_t length);
+};
+
+/*
+ * A whole-array operation, with the SPI transfers for every word prepared up
+ * front: a command header from the tables, followed by the data word, in or
+ * out of 'buf'. Words are submitted in messages of up to 'words_per_msg'.
+ */
+struct xfer_plan {
+	struct spi_ioc_transfer *xfers;
+	uint8_t *buf;
+	/* Which bytes of 'buf' to write, or NULL for all of them. */
+	const uint8_t *dirty;
+	/* For paced writes, the status sampled after each word's pause. */
+	uint8_t *status;
+	size_t nr_words;
+	size_t words_per_msg;
+	/* Command header and data, plus a pause and status when paced. */
+	size_t xfers_per_word;
+	bool paced;
+	enum stats_op op;
+	uint32_t speed_hz;
+};
+
 struct eeprom_cfg {
 	const char *filename;
 	const char *spidev;
+	/* Format of 'filename', or NULL to go by its extension. */
+	const struct image_format *format;
+	/* Image to write, if already loaded from 'filename'. */
+	const struct eeprom_image *image;
+	/* Fields patched into 'image', and the number of this device. */
+	const struct template *tmpl;
+	unsigned int index;
+	/* Part of the array to operate on, in bytes. A length of 0 means all. */
+	size_t offset;
+	size_t length;
 	struct eeprom *eeprom;
 	enum eeprom_action action;
 	bool burst_read;
+	bool speed_auto;
+	bool speed_retune;
+	bool diff_write;
+	bool verify;
+	/* Don't use, or update, the shadow cache of the device's contents. */
+	bool no_cache;
+	enum stats_format stats_format;
+};
+
+/* Clock rates tried, in order, when auto-tuning the SPI clock. */
+static const uint32_t tune_speeds_hz[] = {
+	SPI_SAFE_SPEED_HZ, 250000, 500000, 1000000, 2000000, 3000000, 4000000,
 };
 
 static const struct eeprom eeprom_types_list[] = { {
 	.name = "93c66",
+	.twc_typ_us = 3000,
+	.twc_max_us = 10000,
 	.size = 512,
 	.addr_bits = 9,
 	.flags = EEPROM_ORG,
 }, {
 	.name = "93c56",
+	.twc_typ_us = 3000,
+	.twc_max_us = 10000,
 	.size = 256,
 	.addr_bits = 8,
 	.flags = EEPROM_ORG,
 }, {
 	.name = "93c46",
+	.twc_typ_us = 3000,
+	.twc_max_us = 10000,
 	.size = 128,
 	.addr_bits = 7,
 	.flags = EEPROM_ORG,
 }, {
 	.name = "93c06",
+	.twc_typ_us = 3000,
+	.twc_max_us = 10000,
 	.size = 32,
 	.addr_bits = 6,
 	.flags = EEPROM_X16,
@@ -97,34 +366,82 @@ static const struct eeprom *eeprom_find(const char *type)
 }
 
 static int eeprom_run(const struct eeprom_cfg *);
+static int eeprom_run_gang(const struct eeprom_cfg *, char **, size_t);
+static int eeprom_daemon(const struct eeprom_cfg *, const char *);
+static void print_stats(const struct eeprom_stats *, enum stats_format);
 static int sanitize_input(const struct eeprom_cfg *);
+static int expand_devices(const char *list, glob_t *devices);
+static const struct wait_strategy *wait_strategy_find(const char *name);
+static const struct image_format *image_format_find(const char *name);
+static const struct image_format *image_format_of(const struct eeprom_cfg *);
+static int template_load(const struct eeprom *, const char *,
+			 struct template *);
+static void template_free(struct template *);
+static int shadow_load(const struct eeprom_cfg *, uint8_t *);
+static void shadow_store(const struct eeprom_cfg *, const uint8_t *);
+static void shadow_written(const struct eeprom_cfg *, const struct xfer_plan *,
+			   const uint8_t *, bool);
 
+/* Programs which reuse this file, like the benchmark, bring their own main(). */
+#ifndef EEPROM_93CXX_NO_MAIN
 const char help[] =
-"  -D, --spi-device <dev> Specify SPI device\n"
+"  -D, --spi-device <dev> Specify SPI device, or 'sim[:<file>]'. A comma\n"
+"                       separated list, or glob, drives several devices in\n"
+"                       parallel, with reads saved to '<file>.<device>'\n"
 "  -t, --eeprom-type    Specify EEPROM type/part number\n"
 "  --x16                Specify if EEPROM is an x16 configuration\n"
 "  -r, --read <file>    Save contents of EEPROM to 'file'\n"
 "  -w, --write <file>   Write contents of 'file' to EEPROM\n"
-"  --burst-read         (advanced) Read EEPROM in single read command\n"
+"  --format <fmt>       Format of 'file': 'raw', 'ihex', 'srec' or\n"
+"                       'sparse'. By default, guessed from the extension\n"
+"  --diff               Only write words which differ from the EEPROM\n"
+"  --verify             Read back and check the EEPROM after writing\n"
+"  --template <file>    Personalize the image written to each device with\n"
+"                       the fields defined in 'file'. Implies --diff\n"
+"  --index <nr>         Number of the first device, for templates\n"
+"  --pad-cmds           Pad commands to 16 bits, even if the SPI controller\n"
+"                       can send them at their exact width\n"
+"  --no-cache           Always read the EEPROM, instead of using its cached\n"
+"                       contents when they still match\n"
+"  --word-read          Read EEPROM with one read command per word, instead\n"
+"                       of sequential reads\n"
+"  -f, --speed <hz>     SPI clock in Hz, 'auto' to use the rate found by a\n"
+"                       previous tune, or 'tune' to find the fastest one\n"
 "  -e, --erase          Erase EEPROM\n"
+"  --offset <bytes>     Only read, write or erase from this offset on\n"
+"  --length <bytes>     Only read, write or erase this many bytes\n"
+"  --wait <strategy>    How to wait for write cycles: 'backoff' (default),\n"
+"                       'spin', or 'paced' to have the kernel pace batches\n"
+"                       of writes\n"
 "  -b, --addr-bits <nr> Specify number of address bits in command header\n"
 "  -s, --eeprom-size <nr> Specify size of EEPROM in bytes\n"
+"  --stats[=json]       Print SPI transaction statistics at exit\n"
+"  --daemon <socket>    Keep devices open, and take jobs over a Unix socket\n"
 "  -h, --help           Display this help menu\n"
 "Examples:\n"
 "  %s -D /dev/spidev2.0 -r eeprom.bin -t 93c66 --x16\n"
-"  %s -D /dev/spidev2.0 -e -b8 -s 512 --x16\n";
+"  %s -D /dev/spidev2.0 -e -b8 -s 512 --x16\n"
+"  %s -D '/dev/spidev*.0' -w eeprom.bin -t 93c46 --verify\n";
 
 static void print_help(const char *program_name)
 {
-	printf(help, program_name, program_name);
+	printf(help, program_name, program_name, program_name);
 }
 
 int main(int argc, char *argv[])
 {
 	const char *eeprom_type = NULL;
 	const struct eeprom *eepromy;
-	int opt, x16 = 0, burst = 0, option_index = 0;
+	int opt, x16 = 0, burst = 1, diff = 0, verify = 0, option_index = 0;
+	int pad_cmds = 0, no_cache = 0;
+	int ret;
+	uint32_t speed_hz = SPI_SAFE_SPEED_HZ;
+	const struct wait_strategy *wait = wait_strategy_find("backoff");
 	bool parameter_specified = false, type_specified = false;
+	glob_t devices;
+	struct eeprom_stats stats = {0};
+	const char *template_file = NULL, *daemon_path = NULL;
+	struct template tmpl;
 
 	/* Start with some defauls. */
 	struct eeprom eeprom = {
@@ -133,6 +450,9 @@ int main(int argc, char *argv[])
 		.size = 256,
 		.is_x16 = 0,
 		.flags = EEPROM_ORG,
+		.speed_hz = SPI_SAFE_SPEED_HZ,
+		.twc_typ_us = DEFAULT_TWC_TYP_US,
+		.twc_max_us = DEFAULT_TWC_MAX_US,
 	};
 	struct eeprom_cfg cfg = {
 		.spidev = "/dev/spidev1.0",
@@ -150,14 +470,28 @@ int main(int argc, char *argv[])
 		{"x16",		no_argument,		&x16, 1},
 		{"read",	required_argument,	0, 'r'},
 		{"write",	required_argument,	0, 'w'},
+		{"format",	required_argument,	0, 'F'},
+		{"diff",	no_argument,		&diff, 1},
+		{"verify",	no_argument,		&verify, 1},
+		{"template",	required_argument,	0, 'T'},
+		{"index",	required_argument,	0, 'I'},
 		{"erase",	no_argument,		0, 'e'},
+		{"offset",	required_argument,	0, 'O'},
+		{"length",	required_argument,	0, 'L'},
 		{"burst-read",	no_argument,		&burst, 1},
+		{"word-read",	no_argument,		&burst, 0},
+		{"pad-cmds",	no_argument,		&pad_cmds, 1},
+		{"no-cache",	no_argument,		&no_cache, 1},
+		{"speed",	required_argument,	0, 'f'},
+		{"wait",	required_argument,	0, 'W'},
+		{"stats",	optional_argument,	0, 'S'},
+		{"daemon",	required_argument,	0, 'A'},
 		{"help",	no_argument,		0, 'h'},
 		{0, 0, 0, 0}
 	};
 
 	while (1) {
-		opt = getopt_long(argc, argv, "D:t:b:s:r:w:v:e",
+		opt = getopt_long(argc, argv, "D:t:b:s:r:w:v:ef:",
 				  long_options, &option_index);
 
 		if (opt == EOF)
@@ -193,6 +527,63 @@ int main(int argc, char *argv[])
 			case 'e':
 				config->action = EEPROM_ERASE;
 				break;
+			case 'A':
+				daemon_path = strdup(optarg);
+				break;
+			case 'O':
+				config->offset = strtoul(optarg, NULL, 0);
+				break;
+			case 'L':
+				config->length = strtoul(optarg, NULL, 0);
+				break;
+			case 'T':
+				template_file = strdup(optarg);
+				break;
+			case 'I':
+				config->index = strtoul(optarg, NULL, 0);
+				break;
+			case 'F':
+				config->format = image_format_find(optarg);
+				if (!config->format) {
+					fprintf(stderr, "Unknown image format: %s\n",
+						optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'f':
+				if (!strcasecmp(optarg, "auto")) {
+					config->speed_auto = true;
+				} else if (!strcasecmp(optarg, "tune")) {
+					config->speed_auto = true;
+					config->speed_retune = true;
+				} else {
+					speed_hz = strtoul(optarg, NULL, 0);
+					if (speed_hz == 0) {
+						fprintf(stderr, "Invalid SPI speed: %s\n",
+							optarg);
+						return EXIT_FAILURE;
+					}
+				}
+				break;
+			case 'W':
+				wait = wait_strategy_find(optarg);
+				if (!wait) {
+					fprintf(stderr, "Unknown wait strategy: %s\n",
+						optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'S':
+				if (!optarg || !strcasecmp(optarg, "table")) {
+					config->stats_format = STATS_TABLE;
+				} else if (!strcasecmp(optarg, "json")) {
+					config->stats_format = STATS_JSON;
+				} else {
+					fprintf(stderr, "Unknown stats format: %s\n",
+						optarg);
+					return EXIT_FAILURE;
+				}
+				break;
 			case 'h':
 				print_help(argv[0]);
 				exit(EXIT_SUCCESS);
@@ -203,7 +594,13 @@ int main(int argc, char *argv[])
 	}
 
 	config->eeprom->is_x16 = x16;
+	config->eeprom->speed_hz = speed_hz;
+	config->eeprom->wait = wait;
+	config->eeprom->pad_cmds = pad_cmds;
 	config->burst_read = burst;
+	config->diff_write = diff;
+	config->verify = verify;
+	config->no_cache = no_cache;
 
 	if (type_specified && parameter_specified) {
 		fprintf(stderr, "Please specify either EEPROM type, or EEPROM"
@@ -222,6 +619,9 @@ int main(int argc, char *argv[])
 
 		*config->eeprom = *eepromy;
 		config->eeprom->is_x16 = x16;
+		config->eeprom->speed_hz = speed_hz;
+		config->eeprom->wait = wait;
+		config->eeprom->pad_cmds = pad_cmds;
 		/* x16 mode uses one less address bits than x8 */
 		if (x16)
 			config->eeprom->addr_bits--;
@@ -230,20 +630,124 @@ int main(int argc, char *argv[])
 	if (sanitize_input(config) < 0)
 		return EXIT_FAILURE;
 
-	return eeprom_run(config);
+	if (template_file) {
+		if (config->action != EEPROM_WRITE && !daemon_path) {
+			fprintf(stderr, "Templates only apply to writes\n");
+			return EXIT_FAILURE;
+		}
+
+		if (template_load(config->eeprom, template_file, &tmpl) < 0)
+			return EXIT_FAILURE;
+
+		config->tmpl = &tmpl;
+		/* Only the words which differ from the last device change. */
+		config->diff_write = true;
+	}
+
+	if (daemon_path) {
+		/* Jobs run for as long as the daemon, so there's no exit. */
+		if (config->stats_format != STATS_NONE) {
+			fprintf(stderr, "--stats does not apply to --daemon\n");
+			if (config->tmpl)
+				template_free(&tmpl);
+			return EXIT_FAILURE;
+		}
+
+		ret = eeprom_daemon(config, daemon_path);
+		if (config->tmpl)
+			template_free(&tmpl);
+		return ret;
+	}
+
+	if (expand_devices(config->spidev, &devices) < 0)
+		return EXIT_FAILURE;
+
+	if (config->stats_format != STATS_NONE)
+		config->eeprom->stats = &stats;
+
+	if (devices.gl_pathc > 1) {
+		ret = eeprom_run_gang(config, devices.gl_pathv,
+				      devices.gl_pathc);
+	} else {
+		/* A glob may still match a single device. */
+		config->spidev = devices.gl_pathv[0];
+		ret = eeprom_run(config);
+	}
+
+	print_stats(&stats, config->stats_format);
+	globfree(&devices);
+
+	if (config->tmpl)
+		template_free(&tmpl);
+
+	return ret;
 }
 
-static int sanitize_input(const struct eeprom_cfg *config)
+#endif /* EEPROM_93CXX_NO_MAIN */
+
+/* Expand a comma separated list of device paths and globs. */
+static int expand_devices(const char *list, glob_t *devices)
 {
-	uint8_t comm_bits;
+	char *patterns, *pattern, *saveptr;
+	int flags = GLOB_NOCHECK;
+
+	memset(devices, 0, sizeof(*devices));
+	patterns = strdup(list);
+	if (!patterns)
+		return -1;
+
+	for (pattern = strtok_r(patterns, ",", &saveptr); pattern;
+	     pattern = strtok_r(NULL, ",", &saveptr)) {
+		/*
+		 * The simulator creates its backing file, so there may be
+		 * nothing to match, and the pattern would be taken literally.
+		 */
+		if (!strncmp(pattern, "sim:", 4) && strpbrk(pattern, "*?[")) {
+			fprintf(stderr, "Simulated devices can't be globs: "
+				"%s\n", pattern);
+			free(patterns);
+			globfree(devices);
+			return -1;
+		}
+
+		if (glob(pattern, flags, NULL, devices) != 0) {
+			fprintf(stderr, "Could not expand device list %s\n",
+				list);
+			free(patterns);
+			globfree(devices);
+			return -1;
+		}
+		flags |= GLOB_APPEND;
+	}
+
+	free(patterns);
+
+	if (devices->gl_pathc == 0) {
+		fprintf(stderr, "No SPI device given\n");
+		globfree(devices);
+		return -1;
+	}
+
+	if (devices->gl_pathc > GANG_MAX_DEVICES) {
+		fprintf(stderr, "Too many devices. At most %d are supported\n",
+			GANG_MAX_DEVICES);
+		globfree(devices);
+		return -1;
+	}
+
+	return 0;
+}
 
+static int sanitize_input(const struct eeprom_cfg *config)
+{
 	if (config->eeprom->size == 0) {
 		fprintf(stderr, "EEPROM cannot be zero!\n");
 		return -1;
 	}
 
 	if (config->eeprom->size & (config->eeprom->size - 1)) {
-		fprintf(stderr, "Given EEPROM size %u is not a power of 2!\n");
+		fprintf(stderr, "Given EEPROM size %u is not a power of 2!\n",
+			config->eeprom->size);
 		return -1;
 	}
 
@@ -262,280 +766,4484 @@ static int sanitize_input(const struct eeprom_cfg *config)
 			fprintf(stderr, "Selected EEPROM does not support x8 mode.\n");
 			return -1;
 		}
+
+	if (config->eeprom->size / (config->eeprom->is_x16 ? 2 : 1) >
+	    (1 << config->eeprom->addr_bits)) {
+		fprintf(stderr, "%u address bits can't address all words\n",
+			config->eeprom->addr_bits);
+		return -1;
+	}
+
+	if (config->offset >= config->eeprom->size ||
+	    config->length > config->eeprom->size - config->offset) {
+		fprintf(stderr, "Range is outside the EEPROM\n");
+		return -1;
+	}
+
+	if (config->eeprom->is_x16 && ((config->offset | config->length) & 1)) {
+		fprintf(stderr, "Range must be word aligned in x16 mode\n");
+		return -1;
+	}
+
+	return 0;
 }
 
 /*
- * Prepare the command header.
+ * Command header encoding.
  * The opcode and address or data don't add up to an integer number of 8-bit
  * bytes. Some SPI controllers don't like odd-sized words, so it's prudent to
  * have trabsactions in 8-bit multiples.
  * Luckily, the chip only starts interpreting commands when MOSI goes high while
  * CS is asserted (start condition). We can pad the data up to 16 bits with
  * leading zeroes, so that we can use 8-bit transactions.
+ * Dummy bits are clocked in after the address, so that the data that follows
+ * starts on a byte boundary.
+ */
+#define CMD_WORD(op, bits, dummy, addr) \
+	(((4 | (op)) << ((bits) + (dummy))) | ((addr) << (dummy)))
+#define CMD_HDR(op, bits, dummy, addr) \
+	{ CMD_WORD(op, bits, dummy, addr) >> 8, \
+	  CMD_WORD(op, bits, dummy, addr) & 0xff }
+
+/*
+ * Headers for array commands are looked up, rather than computed for every
+ * word. The tables are generated at compile time, for every supported number
+ * of address bits, by repeating CMD_HDR() over the whole address range.
  */
-static void prepare_cmd(const struct eeprom *eeprom,
-			struct spi_ioc_transfer *xfer,
-			uint8_t txbuf[4],
-			uint8_t cmd, uint16_t addr, uint8_t dummy_bits)
+#define CMD_REP2(op, bits, dummy, a) \
+	CMD_HDR(op, bits, dummy, (a)), CMD_HDR(op, bits, dummy, (a) + 1)
+#define CMD_REP4(op, bits, dummy, a) \
+	CMD_REP2(op, bits, dummy, (a)), CMD_REP2(op, bits, dummy, (a) + 2)
+#define CMD_REP8(op, bits, dummy, a) \
+	CMD_REP4(op, bits, dummy, (a)), CMD_REP4(op, bits, dummy, (a) + 4)
+#define CMD_REP16(op, bits, dummy, a) \
+	CMD_REP8(op, bits, dummy, (a)), CMD_REP8(op, bits, dummy, (a) + 8)
+#define CMD_REP32(op, bits, dummy, a) \
+	CMD_REP16(op, bits, dummy, (a)), CMD_REP16(op, bits, dummy, (a) + 16)
+#define CMD_REP64(op, bits, dummy, a) \
+	CMD_REP32(op, bits, dummy, (a)), CMD_REP32(op, bits, dummy, (a) + 32)
+#define CMD_REP128(op, bits, dummy, a) \
+	CMD_REP64(op, bits, dummy, (a)), CMD_REP64(op, bits, dummy, (a) + 64)
+#define CMD_REP256(op, bits, dummy, a) \
+	CMD_REP128(op, bits, dummy, (a)), CMD_REP128(op, bits, dummy, (a) + 128)
+#define CMD_REP512(op, bits, dummy, a) \
+	CMD_REP256(op, bits, dummy, (a)), CMD_REP256(op, bits, dummy, (a) + 256)
+
+#define CMD_TABLES(bits, rep) \
+static const uint8_t cmd_read_a##bits[1 << bits][2] = { \
+	rep(OPCODE_READ, bits, 1, 0) }; \
+static const uint8_t cmd_write_a##bits[1 << bits][2] = { \
+	rep(OPCODE_WRITE, bits, 0, 0) }; \
+static const uint8_t cmd_erase_a##bits[1 << bits][2] = { \
+	rep(OPCODE_ERASE, bits, 0, 0) };
+
+CMD_TABLES(5, CMD_REP32)
+CMD_TABLES(6, CMD_REP64)
+CMD_TABLES(7, CMD_REP128)
+CMD_TABLES(8, CMD_REP256)
+CMD_TABLES(9, CMD_REP512)
+
+struct cmd_table {
+	const uint8_t (*read)[2];
+	const uint8_t (*write)[2];
+	const uint8_t (*erase)[2];
+};
+
+#define CMD_TABLE_ENTRY(bits) \
+	[bits] = { cmd_read_a##bits, cmd_write_a##bits, cmd_erase_a##bits }
+
+/* Indexed by the number of address bits. */
+static const struct cmd_table cmd_tables[] = {
+	CMD_TABLE_ENTRY(5),
+	CMD_TABLE_ENTRY(6),
+	CMD_TABLE_ENTRY(7),
+	CMD_TABLE_ENTRY(8),
+	CMD_TABLE_ENTRY(9),
+};
+
+/* Encode the header of a command which is not in the tables. */
+static void encode_cmd(const struct eeprom *eeprom, uint8_t txbuf[2],
+		       uint8_t cmd, uint16_t addr, uint8_t dummy_bits)
 {
-	uint16_t command, bits;
+	uint16_t command;
 
-	bits = eeprom->addr_bits + dummy_bits;
-	cmd |= 1 << 2;			/* Add the start bit. */
-	addr &= (1 << bits) - 1;	/* Mask off any extra address bits. */
-	command = (cmd << bits) | addr;
+	addr &= (1 << eeprom->addr_bits) - 1;	/* Mask off extra address bits. */
+	command = CMD_WORD(cmd, eeprom->addr_bits, dummy_bits, addr);
+
+	/* Unpadded headers are a single word, in CPU byte order. */
+	if (eeprom->hdr_bits) {
+		memcpy(txbuf, &command, sizeof(command));
+		return;
+	}
 
 	txbuf[0] = command >> 8;
 	txbuf[1] = command;
-	memset(xfer, 0, sizeof(*xfer));
-	xfer->tx_buf = (uintptr_t)txbuf;
-	xfer->bits_per_word = 8;
-	xfer->len = 2;
 }
 
-/* Read from the EEPROM array. */
-static int read_data(const struct eeprom *eeprom, void *data, size_t len,
-		     uint16_t addr)
+/*
+ * The dummy zero of a READ is the last bit clocked in with the header 'rx'.
+ * Returns whether it reads as zero, as it should.
+ */
+static bool hdr_dummy_ok(const struct eeprom *eeprom, const uint8_t rx[2])
 {
-	uint8_t buf[4];
-	struct spi_ioc_transfer xfer[2] = {{0}, {0}};
-
-	prepare_cmd(eeprom, xfer, buf, OPCODE_READ, addr, 1);
-	xfer[0].speed_hz = 100000;
+	uint16_t word;
 
-	xfer[1].rx_buf = (uintptr_t)data;
-	xfer[1].len = len;
-	xfer[1].bits_per_word = 8;
-	xfer[1].speed_hz = 100000;
+	if (!eeprom->hdr_bits)
+		return !(rx[1] & 1);
 
-	return ioctl(eeprom->spi_fd, SPI_IOC_MESSAGE(2), &xfer);
+	memcpy(&word, rx, sizeof(word));
+	return !(word & 1);
 }
 
-static uint8_t read_status(const struct eeprom *eeprom)
+/* Set up 'xfer' to send the two-byte command header 'hdr'. */
+static void prepare_hdr(const struct eeprom *eeprom,
+			struct spi_ioc_transfer *xfer, const uint8_t *hdr)
 {
-	uint8_t status = 0;
-	struct spi_ioc_transfer xfer[1] = {{0}};
+	memset(xfer, 0, sizeof(*xfer));
+	xfer->tx_buf = (uintptr_t)hdr;
+	xfer->bits_per_word = eeprom->hdr_bits ? : 8;
+	xfer->len = 2;
+	xfer->speed_hz = eeprom->speed_hz;
+}
 
-	xfer[0].rx_buf = (uintptr_t)&status;
-	xfer[0].len = 1;
-	xfer[0].bits_per_word = 8;
-	xfer[0].speed_hz = 100000;
+static const struct cmd_table *cmd_table(const struct eeprom *eeprom)
+{
+	if (eeprom->exact)
+		return eeprom->exact;
 
-	ioctl(eeprom->spi_fd, SPI_IOC_MESSAGE(1), xfer);
+	return &cmd_tables[eeprom->addr_bits];
+}
 
-	return status;
+/* Word address 'addr', wrapped to the range of the command tables. */
+static uint16_t cmd_addr(const struct eeprom *eeprom, size_t addr)
+{
+	return addr & ((1 << eeprom->addr_bits) - 1);
 }
 
-static int write_data(const struct eeprom *eeprom, uint16_t addr,
-		      const uint8_t *data, size_t len)
+static uint64_t now_us(void)
 {
-	uint8_t buf[4];
-	struct spi_ioc_transfer xfer[2] = {{0}, {0}};
+	struct timespec ts;
 
-	prepare_cmd(eeprom, xfer, buf, OPCODE_WRITE, addr, 0);
-	xfer[0].speed_hz = 100000;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-	xfer[1].tx_buf = (uintptr_t)data;
-	xfer[1].len = len;
-	xfer[1].bits_per_word = 8;
-	xfer[1].speed_hz = 100000;
+static void sleep_us(uint32_t usecs)
+{
+	struct timespec ts = {
+		.tv_sec = usecs / 1000000,
+		.tv_nsec = (usecs % 1000000) * 1000,
+	};
 
-	return ioctl(eeprom->spi_fd, SPI_IOC_MESSAGE(2), xfer);
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
 }
 
-static int send_command(const struct eeprom *eeprom, uint8_t op, uint8_t subop)
+/* Account 'value' into a log2-bucketed histogram. */
+static void hist_add(struct stats_hist *hist, uint64_t value)
 {
-	uint8_t buf[4];
-	uint16_t subcode = subop << (eeprom->addr_bits - 2);
+	unsigned int bucket = 0;
 
-	struct spi_ioc_transfer xfer[1] = {{0}};
+	while (bucket < STATS_BUCKETS - 1 && (value >> bucket))
+		bucket++;
 
-	prepare_cmd(eeprom, xfer, buf, op, subcode, 0);
-	xfer[0].speed_hz = 100000;
+	if (!hist->count || value < hist->min)
+		hist->min = value;
+	if (value > hist->max)
+		hist->max = value;
 
-	return ioctl(eeprom->spi_fd, SPI_IOC_MESSAGE(1), xfer);
+	hist->count++;
+	hist->total += value;
+	hist->buckets[bucket]++;
 }
 
-static int enable_write(const struct eeprom *eeprom)
+static void hist_merge(struct stats_hist *dst, const struct stats_hist *src)
 {
-	return send_command(eeprom, OPCODE_EWEN, SUBCODE_EWEN);
-}
+	unsigned int i;
 
-static int diable_write(const struct eeprom *eeprom)
-{
-	return send_command(eeprom, OPCODE_EWEN, SUBCODE_EWDS);
-}
+	if (!src->count)
+		return;
 
-static int erase_all(const struct eeprom *eeprom)
-{
-	return send_command(eeprom, OPCODE_EWEN, SUBCODE_ERAL);
+	if (!dst->count || src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+
+	dst->count += src->count;
+	dst->total += src->total;
+	for (i = 0; i < STATS_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
 }
 
-/* Read contents of EEPROM. */
-static int eeprom_read(const struct eeprom_cfg *config)
+/*
+ * Estimate the value below which 'percent' of samples fall. Only the bucket
+ * is known, so its upper bound is returned, clamped to the largest sample.
+ */
+static uint64_t hist_percentile(const struct stats_hist *hist,
+				unsigned int percent)
 {
-	FILE *out;
-	void *buf;
-	int ret, i, step;
-	step = config->eeprom->is_x16 ? 2 : 1;
+	uint64_t seen = 0, target, bound;
+	unsigned int i;
 
-	if (config->burst_read)
-		step = config->eeprom->size;
+	if (!hist->count)
+		return 0;
 
-	out = fopen(config->filename, "w");
-	if (!out) {
-		perror("Could not open output file.");
-		return EXIT_FAILURE;
+	target = (hist->count * percent + 99) / 100;
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target)
+			break;
 	}
 
-	buf = malloc(config->eeprom->size);
-
-	for (i = 0; i < config->eeprom->size; i += step) {
-		ret = read_data(config->eeprom, buf + i, step, i);
-		if (ret < 0) {
-			perror("Could not execute SPI transaction (eeprom read)");
-			return EXIT_FAILURE;
-		}
-	}
+	bound = i ? (1ull << i) - 1 : 0;
+	if (bound > hist->max)
+		bound = hist->max;
+	if (bound < hist->min)
+		bound = hist->min;
 
-	fwrite(buf, 1, config->eeprom->size, out);
-	fclose(out);
-	free(buf);
+	return bound;
 }
 
-static int eeprom_program_array(const struct eeprom *eeprom, const uint8_t *data)
+static int spi_transfer(const struct eeprom *eeprom, enum stats_op op,
+			struct spi_ioc_transfer *xfer, unsigned int nr_xfers)
 {
-	size_t i;
-	uint16_t word;
+	struct eeprom_stats *stats = eeprom->stats;
+	uint64_t start;
+	unsigned int i;
 	int ret;
-	const size_t step = (eeprom->is_x16) ? 2 : 1;
 
-	for (i = 0; i < eeprom->size; i += step) {
-		if (eeprom->is_x16);
-		ret = write_data(eeprom, i / step, data + i, step);
-		if (ret < 0) {
-			perror("Could not execute SPI transaction (eeprom write)");
-			return EXIT_FAILURE;
-		}
+	if (!stats)
+		return eeprom->transport->transfer(eeprom, xfer, nr_xfers);
 
-		while (read_status(eeprom) != 0xff)
-			;
-	}
+	start = now_us();
+	ret = eeprom->transport->transfer(eeprom, xfer, nr_xfers);
+	hist_add(&stats->ioctl_us[op], now_us() - start);
+
+	stats->xfers[op] += nr_xfers;
+	for (i = 0; i < nr_xfers; i++)
+		stats->bytes[op] += xfer[i].len;
+
+	return ret;
 }
 
-/* Program EEPROM. All EEPROMS will erase the word before a write. */
-static int eeprom_write(const struct eeprom_cfg *config)
+/* How many words, each with its own READ command, fit in one message. */
+static size_t read_batch_words(const struct eeprom *eeprom)
 {
-	FILE *in;
-	void *buf;
-	int ret;
-	long int size;
-	size_t num_bytes_in;
+	const size_t step = eeprom->is_x16 ? 2 : 1;
+	size_t max_batch;
 
-	in = fopen(config->filename, "r");
-	if (!in) {
-		perror("Could not open input file.");
-		return EXIT_FAILURE;
-	}
+	/* Each word costs a two-byte command header plus the data. */
+	max_batch = eeprom->bufsiz / (2 + step);
+	if (max_batch > SPI_MAX_XFERS / 2)
+		max_batch = SPI_MAX_XFERS / 2;
+	if (max_batch == 0)
+		max_batch = 1;
+
+	return max_batch;
+}
 
-	buf = malloc(config->eeprom->size);
+/*
+ * Read 'nr_words' consecutive words, starting at word address 'addr'.
+ * Each word gets its own READ command, but as many command/data pairs as the
+ * spidev buffer allows are packed into a single SPI_IOC_MESSAGE, with CS
+ * dropped between words. This saves a syscall per word.
+ */
+static int read_words(const struct eeprom *eeprom, uint8_t *data,
+		      uint16_t addr, size_t nr_words)
+{
+	size_t i, batch, max_batch;
+	const size_t step = eeprom->is_x16 ? 2 : 1;
+	const uint8_t (*hdrs)[2] = cmd_table(eeprom)->read;
+	struct spi_ioc_transfer xfer[SPI_MAX_XFERS];
+	int ret;
 
-	/* Find file size. */
-	fseek(in, 0, SEEK_END);
-	size = ftell(in);
-	rewind(in);
+	max_batch = read_batch_words(eeprom);
 
-	if (size != config->eeprom->size) {
-		fprintf(stderr, "File size does not match EEPROM size!\n");
-		return EXIT_FAILURE;
-	}
+	while (nr_words) {
+		batch = (nr_words < max_batch) ? nr_words : max_batch;
 
-	num_bytes_in = fread(buf, 1, config->eeprom->size, in);
-	if (num_bytes_in != config->eeprom->size) {
-		fprintf(stderr, "Failed to read contents of %s!\n",
-			config->filename);
-		return EXIT_FAILURE;
-	}
+		for (i = 0; i < batch; i++) {
+			prepare_hdr(eeprom, &xfer[2 * i],
+				    hdrs[cmd_addr(eeprom, addr + i)]);
 
-	fclose(in);
+			memset(&xfer[2 * i + 1], 0, sizeof(xfer[0]));
+			xfer[2 * i + 1].rx_buf = (uintptr_t)(data + i * step);
+			xfer[2 * i + 1].len = step;
+			xfer[2 * i + 1].bits_per_word = 8;
+			xfer[2 * i + 1].speed_hz = eeprom->speed_hz;
+			/* Deselect between words, but not after the last one. */
+			xfer[2 * i + 1].cs_change = (i + 1 < batch);
+		}
 
-	ret = enable_write(config->eeprom);
-	if (ret < 0) {
-		perror("Could not execute SPI transaction (enable write)");
-		return EXIT_FAILURE;
+		ret = spi_transfer(eeprom, STATS_READ, xfer, 2 * batch);
+		if (ret < 0)
+			return ret;
 
+		data += batch * step;
+		addr += batch;
+		nr_words -= batch;
 	}
 
-	eeprom_program_array(config->eeprom, buf);
+	return 0;
 }
 
-/* Erase entire contents of the EEPROM. */
-static int eeprom_erase(const struct eeprom_cfg *config)
+/*
+ * Read 'nr_words' consecutive words, starting at word address 'addr', using
+ * the auto-increment of the READ command. There is one command header per
+ * chunk, with chunks as large as the spidev buffer allows. The dummy bit
+ * preceding the data is checked, to make sure the data is aligned.
+ * Returns 0 on success, 1 if the dummy bit isn't there, -1 on SPI errors.
+ */
+static int read_sequential(const struct eeprom *eeprom, uint8_t *data,
+			   uint16_t addr, size_t nr_words)
 {
+	const size_t step = eeprom->is_x16 ? 2 : 1;
+	size_t chunk, max_chunk;
+	uint8_t status[2];
+	struct spi_ioc_transfer xfer[2];
 	int ret;
 
-	ret = enable_write(config->eeprom);
-	if (ret < 0) {
-		perror("Could not execute SPI transaction (enable write)");
-		return EXIT_FAILURE;
-	}
+	/* The header is accounted against the spidev buffer, too. */
+	max_chunk = (eeprom->bufsiz - sizeof(status)) / step;
+	if (max_chunk == 0)
+		max_chunk = 1;
 
-	ret = erase_all(config->eeprom);
-	if (ret < 0) {
-		perror("Could not execute SPI transaction (erase all)");
-		return EXIT_FAILURE;
-	}
-}
+	while (nr_words) {
+		chunk = (nr_words < max_chunk) ? nr_words : max_chunk;
 
-/* Open and configure SPI master. */
-static int init_spi_master(const char *spidev)
-{
-	int spif, ret;
-	/* Mode 0, but with CS active-high */
-	int mode = SPI_MODE_0 | SPI_CS_HIGH;
+		prepare_hdr(eeprom, &xfer[0],
+			    cmd_table(eeprom)->read[cmd_addr(eeprom, addr)]);
+		xfer[0].rx_buf = (uintptr_t)status;
 
-	spif = open(spidev, O_RDWR);
-	if (spif < 0) {
-		perror("Could not open SPI device.");
-		return -1;
-	}
+		memset(&xfer[1], 0, sizeof(xfer[1]));
+		xfer[1].rx_buf = (uintptr_t)data;
+		xfer[1].len = chunk * step;
+		xfer[1].bits_per_word = 8;
+		xfer[1].speed_hz = eeprom->speed_hz;
 
-	ret = ioctl(spif, SPI_IOC_WR_MODE, &mode);
-	if (ret < 0) {
-		perror("Could not set SPI mode.");
-		return -1;
+		ret = spi_transfer(eeprom, STATS_READ, xfer, 2);
+		if (ret < 0)
+			return ret;
+
+		if (!hdr_dummy_ok(eeprom, status))
+			return 1;
+
+		data += chunk * step;
+		addr += chunk;
+		nr_words -= chunk;
 	}
 
-	return spif;
+	return 0;
 }
 
-static int eeprom_run(const struct eeprom_cfg *config)
+/*
+ * Check a sequential read of 'nr_words' from word address 'first' against
+ * individual reads of the words where it is most likely to go wrong: the
+ * first and last words, and the words on each side of a chunk boundary.
+ */
+static bool probe_sequential(const struct eeprom *eeprom, const uint8_t *data,
+			     size_t first, size_t nr_words)
 {
-	int spif, ret, num_words;
+	const size_t step = eeprom->is_x16 ? 2 : 1;
+	size_t chunk, addr;
+	uint8_t probe[4];
+
+	chunk = (eeprom->bufsiz - 2) / step;
+	if (chunk == 0)
+		chunk = 1;
+
+	if (read_words(eeprom, probe, first, 1) < 0 ||
+	    memcmp(probe, data, step))
+		return false;
+
+	if (read_words(eeprom, probe, first + nr_words - 1, 1) < 0 ||
+	    memcmp(probe, data + (nr_words - 1) * step, step))
+		return false;
+
+	for (addr = chunk; addr < nr_words; addr += chunk) {
+		if (read_words(eeprom, probe, first + addr - 1, 2) < 0 ||
+		    memcmp(probe, data + (addr - 1) * step, 2 * step))
+			return false;
+	}
+
+	return true;
+}
+
+static uint8_t read_status(const struct eeprom *eeprom)
+{
+	uint8_t status = 0;
+	struct spi_ioc_transfer xfer[1] = {{0}};
+
+	xfer[0].rx_buf = (uintptr_t)&status;
+	xfer[0].len = 1;
+	xfer[0].bits_per_word = 8;
+	xfer[0].speed_hz = eeprom->speed_hz;
+
+	spi_transfer(eeprom, STATS_STATUS, xfer, 1);
+
+	return status;
+}
+
+/* Poll back-to-back until ready. Lowest latency, but hogs CPU and bus. */
+static int wait_ready_spin(const struct eeprom *eeprom, uint32_t initial_us,
+			   uint32_t timeout_us)
+{
+	const uint64_t deadline = now_us() + timeout_us;
+
+	(void)initial_us;
+
+	while (read_status(eeprom) != 0xff) {
+		if (now_us() > deadline) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Sleep through the typical write cycle, then poll with exponentially
+ * increasing intervals, so that a slow part doesn't cost a stream of ioctls.
+ */
+static int wait_ready_backoff(const struct eeprom *eeprom, uint32_t initial_us,
+			      uint32_t timeout_us)
+{
+	const uint64_t deadline = now_us() + timeout_us;
+	uint32_t interval_us = 50;
+
+	sleep_us(initial_us);
+
+	while (read_status(eeprom) != 0xff) {
+		if (now_us() > deadline) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		sleep_us(interval_us);
+		if (interval_us < 1000)
+			interval_us *= 2;
+	}
+
+	return 0;
+}
+
+static const struct wait_strategy wait_strategies[] = {
+	{ .name = "backoff",	.wait_ready = wait_ready_backoff },
+	{ .name = "spin",	.wait_ready = wait_ready_spin },
+	{ .name = "paced",	.wait_ready = wait_ready_backoff, .paced = true },
+	{ .name = NULL },
+};
+
+static const struct wait_strategy *wait_strategy_find(const char *name)
+{
+	const struct wait_strategy *wait;
+
+	for (wait = wait_strategies; wait->name; wait++) {
+		if (!strcasecmp(wait->name, name))
+			return wait;
+	}
+
+	return NULL;
+}
+
+/* Run the wait strategy, accounting the time spent and status polls. */
+static int wait_cycle(const struct eeprom *eeprom, uint32_t timeout_us)
+{
+	struct eeprom_stats *stats = eeprom->stats;
+	uint64_t start, polls;
+	int ret;
+
+	if (!stats)
+		return eeprom->wait->wait_ready(eeprom, eeprom->twc_typ_us,
+						timeout_us);
+
+	start = now_us();
+	polls = stats->ioctl_us[STATS_STATUS].count;
+	ret = eeprom->wait->wait_ready(eeprom, eeprom->twc_typ_us, timeout_us);
+	hist_add(&stats->wait_us, now_us() - start);
+	hist_add(&stats->polls, stats->ioctl_us[STATS_STATUS].count - polls);
+
+	return ret;
+}
+
+/* Wait for the write cycle of a single word to complete. */
+static int wait_write_cycle(const struct eeprom *eeprom)
+{
+	return wait_cycle(eeprom, 2 * eeprom->twc_max_us);
+}
+
+/* Wait for an operation on the whole array (ERAL, WRAL) to complete. */
+static int wait_bulk_cycle(const struct eeprom *eeprom)
+{
+	return wait_cycle(eeprom, BULK_TWC_FACTOR * eeprom->twc_max_us);
+}
+
+/* Pause after each paced word write: tWC(max), plus some margin. */
+static uint32_t paced_delay_us(const struct eeprom *eeprom)
+{
+	return eeprom->twc_max_us + eeprom->twc_max_us * PACED_TWC_MARGIN / 8;
+}
+
+/* Send a command header 'hdr' followed by a data word (WRITE, WRAL). */
+static int send_data_command(const struct eeprom *eeprom, const uint8_t *hdr,
+			     const uint8_t *data, size_t len)
+{
+	struct spi_ioc_transfer xfer[2] = {{0}, {0}};
+
+	prepare_hdr(eeprom, &xfer[0], hdr);
+
+	xfer[1].tx_buf = (uintptr_t)data;
+	xfer[1].len = len;
+	xfer[1].bits_per_word = 8;
+	xfer[1].speed_hz = eeprom->speed_hz;
+
+	return spi_transfer(eeprom, STATS_WRITE, xfer, 2);
+}
+
+/* Write the same data word to every location in the array. */
+static int write_all(const struct eeprom *eeprom, const uint8_t *data,
+		     size_t len)
+{
+	uint16_t subcode = SUBCODE_WRAL << (eeprom->addr_bits - 2);
+	uint8_t hdr[2];
+
+	encode_cmd(eeprom, hdr, OPCODE_EWEN, subcode, 0);
+	return send_data_command(eeprom, hdr, data, len);
+}
+
+static int send_command(const struct eeprom *eeprom, uint8_t op, uint8_t subop)
+{
+	uint8_t hdr[2];
+	uint16_t subcode = subop << (eeprom->addr_bits - 2);
+
+	struct spi_ioc_transfer xfer[1];
+
+	encode_cmd(eeprom, hdr, op, subcode, 0);
+	prepare_hdr(eeprom, xfer, hdr);
+
+	return spi_transfer(eeprom, STATS_COMMAND, xfer, 1);
+}
+
+static int enable_write(const struct eeprom *eeprom)
+{
+	return send_command(eeprom, OPCODE_EWEN, SUBCODE_EWEN);
+}
+
+static int diable_write(const struct eeprom *eeprom)
+{
+	return send_command(eeprom, OPCODE_EWEN, SUBCODE_EWDS);
+}
+
+static int erase_all(const struct eeprom *eeprom)
+{
+	return send_command(eeprom, OPCODE_EWEN, SUBCODE_ERAL);
+}
+
+/* Erase the word at 'addr', setting it to all ones. */
+static int erase_word(const struct eeprom *eeprom, size_t addr)
+{
+	struct spi_ioc_transfer xfer[1];
+
+	prepare_hdr(eeprom, xfer,
+		    cmd_table(eeprom)->erase[cmd_addr(eeprom, addr)]);
+
+	return spi_transfer(eeprom, STATS_COMMAND, xfer, 1);
+}
+
+static void plan_free(struct xfer_plan *plan)
+{
+	free(plan->xfers);
+	free(plan->status);
+	plan->xfers = NULL;
+	plan->status = NULL;
+}
+
+/* Prepare the data transfers of 'plan', common to reads and writes. */
+static int plan_init(const struct eeprom *eeprom, struct xfer_plan *plan,
+		     uint8_t *buf, enum stats_op op, size_t words_per_msg,
+		     size_t xfers_per_word)
+{
+	const size_t step = eeprom->is_x16 ? 2 : 1;
+	struct spi_ioc_transfer *xfer;
+	size_t i;
+
+	memset(plan, 0, sizeof(*plan));
+	plan->nr_words = eeprom->size / step;
+	plan->xfers = calloc(xfers_per_word * plan->nr_words,
+			     sizeof(*plan->xfers));
+	if (!plan->xfers)
+		return -1;
+
+	plan->buf = buf;
+	plan->words_per_msg = words_per_msg;
+	plan->xfers_per_word = xfers_per_word;
+	plan->op = op;
+	plan->speed_hz = eeprom->speed_hz;
+
+	for (i = 0; i < plan->nr_words; i++) {
+		xfer = &plan->xfers[xfers_per_word * i + 1];
+		xfer->len = step;
+		xfer->bits_per_word = 8;
+		xfer->speed_hz = eeprom->speed_hz;
+	}
+
+	return 0;
+}
+
+/*
+ * Plan reading the whole array into 'buf', one READ command per word. CS is
+ * dropped between the words of a message, but not after the last one.
+ */
+static int plan_read(const struct eeprom *eeprom, struct xfer_plan *plan,
+		     uint8_t *buf)
+{
+	const size_t step = eeprom->is_x16 ? 2 : 1;
+	const uint8_t (*hdrs)[2] = cmd_table(eeprom)->read;
+	size_t i;
+
+	if (plan_init(eeprom, plan, buf, STATS_READ,
+		      read_batch_words(eeprom), 2) < 0)
+		return -1;
+
+	for (i = 0; i < plan->nr_words; i++) {
+		prepare_hdr(eeprom, &plan->xfers[2 * i], hdrs[i]);
+		plan->xfers[2 * i + 1].rx_buf = (uintptr_t)(buf + i * step);
+		plan->xfers[2 * i + 1].cs_change =
+			(i + 1) % plan->words_per_msg && i + 1 < plan->nr_words;
+	}
+
+	return 0;
+}
+
+/* Words in a paced write message, which also limits the time it blocks. */
+static size_t paced_batch_words(const struct eeprom *eeprom)
+{
+	const size_t step = eeprom->is_x16 ? 2 : 1;
+	size_t max_batch;
+
+	/* Each word costs a command header, the data, and a status byte. */
+	max_batch = eeprom->bufsiz / (2 + step + 1);
+	if (max_batch > SPI_MAX_XFERS / 4)
+		max_batch = SPI_MAX_XFERS / 4;
+	if (max_batch > 64)
+		max_batch = 64;
+	if (max_batch == 0)
+		max_batch = 1;
+
+	return max_batch;
+}
+
+/*
+ * Plan writing image 'img' to the whole array. Every word is a message of its
+ * own, as the write cycle must complete before the next command. When paced,
+ * CS drops after each word's data to start its write cycle, and an empty
+ * transfer holds off the next command for tWC, so a batch of words can go in
+ * one message. CS is then raised again to sample the ready status of each
+ * word in the same message. Without the pause, the chip is never done that
+ * early, so unpaced words leave the status to wait_write_cycle().
+ */
+static int plan_write(const struct eeprom *eeprom, struct xfer_plan *plan,
+		      const struct eeprom_image *img)
+{
+	const size_t step = eeprom->is_x16 ? 2 : 1;
+	const uint8_t (*hdrs)[2] = cmd_table(eeprom)->write;
+	const uint8_t *data = img->data;
+	const bool paced = eeprom->wait && eeprom->wait->paced;
+	const size_t stride = paced ? 4 : 2;
+	struct spi_ioc_transfer *xfer;
+	size_t i;
+
+	if (plan_init(eeprom, plan, img->data, STATS_WRITE,
+		      paced ? paced_batch_words(eeprom) : 1, stride) < 0)
+		return -1;
+
+	plan->dirty = img->dirty;
+	plan->paced = paced;
+
+	if (paced) {
+		plan->status = calloc(plan->nr_words, sizeof(*plan->status));
+		if (!plan->status) {
+			plan_free(plan);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < plan->nr_words; i++) {
+		xfer = &plan->xfers[stride * i];
+		prepare_hdr(eeprom, &xfer[0], hdrs[i]);
+		xfer[1].tx_buf = (uintptr_t)(data + i * step);
+		if (!paced)
+			continue;
+
+		xfer[1].cs_change = 1;
+		xfer[2].delay_usecs = paced_delay_us(eeprom);
+		xfer[2].cs_change = 1;
+
+		xfer[3].rx_buf = (uintptr_t)&plan->status[i];
+		xfer[3].len = 1;
+		xfer[3].bits_per_word = 8;
+		xfer[3].speed_hz = eeprom->speed_hz;
+		xfer[3].cs_change = 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Wait for the write cycle of 'word' of 'plan' to complete. Paced plans
+ * sampled its status after the pause, so if the chip was ready then, there is
+ * nothing to wait for.
+ */
+static int plan_wait_cycle(const struct eeprom *eeprom,
+			   const struct xfer_plan *plan, size_t word)
+{
+	if (plan->status && plan->status[word] == 0xff)
+		return 0;
+
+	return wait_write_cycle(eeprom);
+}
+
+/*
+ * Submit words 'word' to 'word + nr_words - 1' of 'plan'. The plan is reused
+ * as is, except for the clock, which is updated if 'eeprom' runs at another
+ * speed than the plan was last used at.
+ */
+static int plan_submit(const struct eeprom *eeprom, struct xfer_plan *plan,
+		       size_t word, size_t nr_words)
+{
+	const size_t stride = plan->xfers_per_word;
+	struct spi_ioc_transfer *last;
+	size_t i, batch;
+	bool cs_change;
+	int ret;
+
+	if (plan->speed_hz != eeprom->speed_hz) {
+		for (i = 0; i < stride * plan->nr_words; i++)
+			plan->xfers[i].speed_hz = eeprom->speed_hz;
+		plan->speed_hz = eeprom->speed_hz;
+	}
+
+	while (nr_words) {
+		batch = plan->words_per_msg - word % plan->words_per_msg;
+		if (batch > nr_words)
+			batch = nr_words;
+
+		/* Don't leave the chip selected when stopping mid-message. */
+		last = &plan->xfers[stride * (word + batch) - 1];
+		cs_change = last->cs_change;
+		last->cs_change = 0;
+
+		ret = spi_transfer(eeprom, plan->op, &plan->xfers[stride * word],
+				   stride * batch);
+		last->cs_change = cs_change;
+		if (ret < 0)
+			return ret;
+
+		word += batch;
+		nr_words -= batch;
+	}
+
+	return 0;
+}
+
+/*
+ * Plan of whole array reads into 'buf'. An open device keeps it, so repeated
+ * reads, as in the daemon, or a verify after a write, only point it at their
+ * buffer.
+ */
+static struct xfer_plan *eeprom_read_plan(struct eeprom *eeprom, uint8_t *buf)
+{
+	const size_t step = eeprom->is_x16 ? 2 : 1;
+	struct xfer_plan *plan = eeprom->read_plan;
+	size_t i;
+
+	if (!plan) {
+		plan = malloc(sizeof(*plan));
+		if (!plan || plan_read(eeprom, plan, buf) < 0) {
+			free(plan);
+			return NULL;
+		}
+		eeprom->read_plan = plan;
+	} else if (plan->buf != buf) {
+		for (i = 0; i < plan->nr_words; i++)
+			plan->xfers[2 * i + 1].rx_buf =
+				(uintptr_t)(buf + i * step);
+		plan->buf = buf;
+	}
+
+	return plan;
+}
+
+/*
+ * Read 'nr_words' from word address 'first' into 'data'. Sequential reads are
+ * used, unless disabled, or found not to work, in which case there's one read
+ * command per word.
+ */
+static int read_range(const struct eeprom_cfg *config, uint8_t *data,
+		      size_t first, size_t nr_words)
+{
+	struct eeprom *eeprom = config->eeprom;
+	const size_t step = eeprom->is_x16 ? 2 : 1;
+	struct xfer_plan *plan;
+	int ret;
+
+	if (config->burst_read && !eeprom->no_seq_read) {
+		ret = read_sequential(eeprom, data, first, nr_words);
+		if (ret < 0)
+			return ret;
+
+		if (ret == 0 && probe_sequential(eeprom, data, first, nr_words))
+			return 0;
+
+		fprintf(stderr, "Sequential read failed validation. Falling "
+			"back to word reads.\n");
+		eeprom->no_seq_read = true;
+	}
+
+	if (first || nr_words != eeprom->size / step)
+		return read_words(eeprom, data, first, nr_words);
+
+	plan = eeprom_read_plan(eeprom, data);
+	if (!plan)
+		return -1;
+
+	return plan_submit(eeprom, plan, 0, plan->nr_words);
+}
+
+/* Read the whole array into 'buf'. */
+static int read_array(const struct eeprom_cfg *config, uint8_t *buf)
+{
+	const size_t step = config->eeprom->is_x16 ? 2 : 1;
+
+	return read_range(config, buf, 0, config->eeprom->size / step);
+}
+
+/* Length of the part of the array selected with --offset and --length. */
+static size_t range_length(const struct eeprom_cfg *config)
+{
+	return config->length ? config->length :
+	       config->eeprom->size - config->offset;
+}
+
+/*
+ * Read the whole array into 'data', or take it from the shadow cache, if the
+ * device still matches it. What is read is saved to the cache.
+ */
+static int read_current(const struct eeprom_cfg *config, uint8_t *data)
+{
+	if (shadow_load(config, data) == 0)
+		return 0;
+
+	if (read_array(config, data) < 0)
+		return -1;
+
+	shadow_store(config, data);
+	return 0;
+}
+
+/*
+ * Read the part of the array selected with --offset and --length. A part is
+ * only taken from the shadow cache, but doesn't refresh it.
+ */
+static int read_selected(const struct eeprom_cfg *config, uint8_t *data)
+{
+	const struct eeprom *eeprom = config->eeprom;
+	const size_t step = eeprom->is_x16 ? 2 : 1;
+	const size_t length = range_length(config);
+	uint8_t *full;
+
+	if (length == eeprom->size)
+		return read_current(config, data);
+
+	full = config->no_cache ? NULL : malloc(eeprom->size);
+	if (full && shadow_load(config, full) == 0) {
+		memcpy(data, full + config->offset, length);
+		free(full);
+		return 0;
+	}
+
+	free(full);
+	return read_range(config, data, config->offset / step, length / step);
+}
+
+/* Read contents of EEPROM into a buffer, then write it out to 'fd'. */
+static int eeprom_read_stream(const struct eeprom_cfg *config, int fd)
+{
+	const size_t length = range_length(config);
+	uint8_t *buf;
+	FILE *out;
+	int ret;
+
+	out = fdopen(fd, "w");
+	buf = malloc(length);
+	if (!out || !buf) {
+		perror("Could not allocate read buffer");
+		if (out)
+			fclose(out);
+		else
+			close(fd);
+		free(buf);
+		return EXIT_FAILURE;
+	}
+
+	if (read_selected(config, buf) < 0) {
+		perror("Could not execute SPI transaction (eeprom read)");
+		fclose(out);
+		free(buf);
+		return EXIT_FAILURE;
+	}
+
+	ret = fwrite(buf, 1, length, out) == length ? 0 : -1;
+	if (fclose(out) < 0 || ret < 0) {
+		perror("Could not write output file");
+		ret = -1;
+	}
+
+	free(buf);
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Read contents of EEPROM into a raw file. A regular output file is sized up
+ * front and mapped, so the read transfers land directly in it. Anything else,
+ * such as a pipe, is written in one go after the read.
+ */
+static int eeprom_read_raw(const struct eeprom_cfg *config)
+{
+	const size_t length = range_length(config);
+	struct stat st;
+	uint8_t *buf;
+	int fd, ret;
+
+	fd = open(config->filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		fd = open(config->filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		perror("Could not open output file.");
+		return EXIT_FAILURE;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		perror("Could not stat output file");
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	/* Pipes, terminals and sockets can't be sized, or mapped. */
+	if (!S_ISREG(st.st_mode) ||
+	    (fcntl(fd, F_GETFL) & O_ACCMODE) != O_RDWR)
+		return eeprom_read_stream(config, fd);
+
+	if (ftruncate(fd, length) < 0) {
+		perror("Could not size output file");
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	buf = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	if (buf == MAP_FAILED) {
+		perror("Could not map output file");
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	ret = read_selected(config, buf);
+	if (ret < 0) {
+		perror("Could not execute SPI transaction (eeprom read)");
+		munmap(buf, length);
+		/* Don't leave a file of zeroes behind, which looks like data. */
+		if (ftruncate(fd, 0) < 0)
+			perror("Could not truncate output file");
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	/* Write errors of a shared mapping only show up here. */
+	if (msync(buf, length, MS_SYNC) < 0) {
+		perror("Could not write output file");
+		munmap(buf, length);
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	munmap(buf, length);
+
+	if (close(fd) < 0) {
+		perror("Could not write output file");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* Read contents of EEPROM, and save them in the format of the output file. */
+static int eeprom_read(const struct eeprom_cfg *config)
+{
+	const struct image_format *format = image_format_of(config);
+	const struct eeprom *eeprom = config->eeprom;
+	uint8_t *buf;
+	FILE *out;
+	int ret;
+
+	if (!format->save)
+		return eeprom_read_raw(config);
+
+	buf = malloc(eeprom->size);
+	if (!buf) {
+		perror("Could not allocate read buffer");
+		return EXIT_FAILURE;
+	}
+
+	if (read_selected(config, buf + config->offset) < 0) {
+		perror("Could not execute SPI transaction (eeprom read)");
+		free(buf);
+		return EXIT_FAILURE;
+	}
+
+	out = fopen(config->filename, "w");
+	if (!out) {
+		perror("Could not open output file.");
+		free(buf);
+		return EXIT_FAILURE;
+	}
+
+	ret = format->save(eeprom, out, buf, config->offset,
+			   range_length(config));
+	if (fclose(out) < 0 || ret < 0) {
+		perror("Could not write output file");
+		ret = -1;
+	}
+
+	free(buf);
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Whether the word at byte offset 'i' of 'plan' needs to be written. */
+static bool plan_word_wanted(const struct xfer_plan *plan, const uint8_t *cur,
+			     size_t i, size_t step)
+{
+	const uint8_t *data = plan->buf;
+
+	if (plan->dirty && !plan->dirty[i])
+		return false;
+
+	return !cur || memcmp(cur + i, data + i, step);
+}
+
+/*
+ * Program the data of 'plan' into the array. Words the image doesn't address
+ * are left alone. If the current contents are given in 'cur', words which
+ * already hold the right value are skipped. Those are only reported when
+ * 'diff' says 'cur' was read for --diff, rather than after a bulk write, or a
+ * failed verify. Paced plans are submitted in runs of consecutive words to
+ * write, and each word's status checked afterwards.
+ */
+static int eeprom_program_array(const struct eeprom *eeprom,
+				struct xfer_plan *plan, const uint8_t *cur,
+				bool diff)
+{
+	size_t i, k, n, failed = 0, skipped = 0, untouched = 0;
+	int ret;
+	const size_t step = (eeprom->is_x16) ? 2 : 1;
+
+	for (i = 0; i < eeprom->size; i += n * step) {
+		n = 1;
+		if (plan->dirty && !plan->dirty[i]) {
+			untouched++;
+			continue;
+		}
+
+		if (!plan_word_wanted(plan, cur, i, step)) {
+			skipped++;
+			continue;
+		}
+
+		while (plan->paced && i + n * step < eeprom->size &&
+		       plan_word_wanted(plan, cur, i + n * step, step))
+			n++;
+
+		ret = plan_submit(eeprom, plan, i / step, n);
+		if (ret < 0) {
+			perror("Could not execute SPI transaction (eeprom write)");
+			return EXIT_FAILURE;
+		}
+
+		/* A busy chip ignores commands, so the next word was lost. */
+		for (k = 0; k + 1 < n; k++) {
+			if (plan->status[i / step + k] != 0xff) {
+				fprintf(stderr, "Word 0x%03zx: write cycle took "
+					"longer than %u us\n", i / step + k,
+					paced_delay_us(eeprom));
+				failed++;
+			}
+		}
+
+		ret = plan_wait_cycle(eeprom, plan, i / step + n - 1);
+		if (ret < 0) {
+			fprintf(stderr, "Word 0x%03zx: write cycle did not "
+				"complete within %u us\n", (i / step) + n - 1,
+				2 * eeprom->twc_max_us);
+			failed += n;
+		}
+	}
+
+	if (cur && diff)
+		printf("Skipped %zu of %zu unchanged words\n", skipped,
+		       eeprom->size / step);
+	if (plan->dirty)
+		printf("Left %zu of %zu words not in the image untouched\n",
+		       untouched, eeprom->size / step);
+
+	if (failed) {
+		fprintf(stderr, "%zu words failed to program\n", failed);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* A device programmed by eeprom_program_interleaved(). */
+struct write_target {
+	const struct eeprom *eeprom;
+	struct xfer_plan *plan;
+	const uint8_t *cur;
+	/* Whether 'cur' was read for --diff, so skipped words are reported. */
+	bool diff;
+	const char *name;
+	/* Byte offset of the word being written, or to look at next. */
+	size_t next;
+	uint64_t poll_at, deadline, done_us;
+	size_t skipped, untouched, failed;
+	bool busy, done;
+	int result;
+};
+
+/* Move 'target' to the next word which needs writing, if any is left. */
+static bool target_next_word(struct write_target *t)
+{
+	const size_t step = t->eeprom->is_x16 ? 2 : 1;
+	const uint8_t *data = t->plan->buf;
+
+	for (; t->next < t->eeprom->size; t->next += step) {
+		if (t->plan->dirty && !t->plan->dirty[t->next])
+			t->untouched++;
+		else if (t->cur && !memcmp(t->cur + t->next, data + t->next, step))
+			t->skipped++;
+		else
+			return true;
+	}
+
+	return false;
+}
+
+/* Poll a busy target. Returns true once its write cycle is over. */
+static bool target_poll(struct write_target *t, uint64_t *wake)
+{
+	const size_t step = t->eeprom->is_x16 ? 2 : 1;
+	uint64_t now = now_us();
+
+	if (now < t->poll_at) {
+		if (t->poll_at < *wake)
+			*wake = t->poll_at;
+		return false;
+	}
+
+	if (read_status(t->eeprom) != 0xff) {
+		if (now <= t->deadline) {
+			t->poll_at = now + INTERLEAVE_POLL_US;
+			if (t->poll_at < *wake)
+				*wake = t->poll_at;
+			return false;
+		}
+
+		fprintf(stderr, "%s: word 0x%03zx: write cycle did not "
+			"complete within %u us\n", t->name, t->next / step,
+			2 * t->eeprom->twc_max_us);
+		t->failed++;
+	}
+
+	t->busy = false;
+	t->next += step;
+	return true;
+}
+
+/*
+ * Program several devices on the same bus at once. Instead of idling through
+ * the write cycle of each word, the next word is sent to another device, and
+ * busy devices are polled in turn, so that their write cycles overlap.
+ * Like eeprom_program_array(), words not in the image, or already holding
+ * the right value, are skipped. Write must be enabled on all targets.
+ */
+static void eeprom_program_interleaved(struct write_target *targets,
+				       size_t nr_targets)
+{
+	struct write_target *t;
+	size_t i, step, active = nr_targets;
+	uint64_t now, wake;
+	bool progress;
+
+	while (active) {
+		progress = false;
+		wake = UINT64_MAX;
+
+		for (i = 0; i < nr_targets; i++) {
+			t = &targets[i];
+			step = t->eeprom->is_x16 ? 2 : 1;
+			if (t->done)
+				continue;
+
+			if (t->busy && !target_poll(t, &wake))
+				continue;
+
+			progress = true;
+			if (target_next_word(t)) {
+				if (plan_submit(t->eeprom, t->plan, t->next / step,
+						1) == 0) {
+					now = now_us();
+					t->busy = true;
+					t->poll_at = now + t->eeprom->twc_typ_us;
+					t->deadline = now + 2 * t->eeprom->twc_max_us;
+					continue;
+				}
+
+				perror("Could not execute SPI transaction "
+				       "(eeprom write)");
+				t->result = EXIT_FAILURE;
+			} else if (t->failed) {
+				fprintf(stderr, "%s: %zu words failed to "
+					"program\n", t->name, t->failed);
+				t->result = EXIT_FAILURE;
+			}
+
+			t->done = true;
+			t->done_us = now_us();
+			active--;
+		}
+
+		/* Everything is busy: sleep until the next poll is due. */
+		if (!progress && wake != UINT64_MAX &&
+		    targets->eeprom->wait->wait_ready != wait_ready_spin) {
+			now = now_us();
+			if (wake > now)
+				sleep_us(wake - now);
+		}
+	}
+
+	for (i = 0; i < nr_targets; i++) {
+		t = &targets[i];
+		step = t->eeprom->is_x16 ? 2 : 1;
+		if (t->cur && t->diff)
+			printf("%s: Skipped %zu of %zu unchanged words\n",
+			       t->name, t->skipped, t->eeprom->size / step);
+		if (t->plan->dirty)
+			printf("%s: Left %zu of %zu words not in the image "
+			       "untouched\n", t->name, t->untouched,
+			       t->eeprom->size / step);
+	}
+}
+
+static int compare_words(const void *a, const void *b)
+{
+	return *(const uint16_t *)a - *(const uint16_t *)b;
+}
+
+/*
+ * Find the most common word in 'data'. Its value is stored, in array byte
+ * order, in 'value', and the number of times it occurs is returned.
+ */
+static size_t dominant_word(const struct eeprom *eeprom, const uint8_t *data,
+			    uint8_t value[2])
+{
+	const size_t step = (eeprom->is_x16) ? 2 : 1;
+	const size_t nr_words = eeprom->size / step;
+	size_t i, run = 0, best_run = 0;
+	uint16_t *words, best = 0;
+
+	words = malloc(nr_words * sizeof(*words));
+	if (!words)
+		return 0;
+
+	for (i = 0; i < nr_words; i++)
+		words[i] = (step == 2) ? (data[2 * i] << 8 | data[2 * i + 1])
+				       : data[i];
+
+	qsort(words, nr_words, sizeof(*words), compare_words);
+
+	for (i = 0; i < nr_words; i++) {
+		run = (i && words[i] == words[i - 1]) ? run + 1 : 1;
+		if (run > best_run) {
+			best_run = run;
+			best = words[i];
+		}
+	}
+
+	free(words);
+
+	if (step == 2) {
+		value[0] = best >> 8;
+		value[1] = best;
+	} else {
+		value[0] = best;
+	}
+
+	return best_run;
+}
+
+/*
+ * ERAL and WRAL set the entire array in about the time of a few word writes.
+ * When most of the image in 'plan' is a single value, set the whole array to
+ * it in one go, and read it back into a new buffer, returned in 'readback',
+ * so only the words which still differ need patching. 'cur' holds the
+ * current contents, if known. Returns 1 if the array was set, 0 if it was
+ * not worth it, and -1 on error.
+ */
+static int eeprom_program_bulk(const struct eeprom_cfg *config,
+			       const struct xfer_plan *plan, const uint8_t *cur,
+			       uint8_t **readback)
+{
+	const struct eeprom *eeprom = config->eeprom;
+	const uint8_t *data = plan->buf;
+	const size_t step = (eeprom->is_x16) ? 2 : 1;
+	const size_t nr_words = eeprom->size / step;
+	size_t i, nr_dominant, nr_writes = nr_words;
+	uint8_t value[2];
+	bool erased;
+	int ret;
+
+	/* ERAL and WRAL would clobber the words the image doesn't address. */
+	if (plan->dirty)
+		return 0;
+
+	if (cur) {
+		for (i = 0, nr_writes = 0; i < eeprom->size; i += step)
+			nr_writes += !!memcmp(cur + i, data + i, step);
+	}
+
+	nr_dominant = dominant_word(eeprom, data, value);
+	if (BULK_WRITE_COST + nr_words - nr_dominant >= nr_writes)
+		return 0;
+
+	/* Erased cells read as all ones, so ERAL is a WRAL of 0xffff. */
+	erased = value[0] == 0xff && (step == 1 || value[1] == 0xff);
+	if (erased)
+		ret = erase_all(eeprom);
+	else
+		ret = write_all(eeprom, value, step);
+
+	if (ret < 0) {
+		perror("Could not execute SPI transaction (write all)");
+		return -1;
+	}
+
+	if (wait_bulk_cycle(eeprom) < 0) {
+		fprintf(stderr, "%s did not complete within %u us\n",
+			erased ? "ERAL" : "WRAL",
+			BULK_TWC_FACTOR * eeprom->twc_max_us);
+		return -1;
+	}
+
+	printf("Programmed %zu of %zu words with %s\n", nr_dominant, nr_words,
+	       erased ? "ERAL" : "WRAL");
+
+	*readback = malloc(eeprom->size);
+	if (!*readback || read_array(config, *readback) < 0) {
+		perror("Could not read back EEPROM contents");
+		free(*readback);
+		*readback = NULL;
+		return -1;
+	}
+
+	return 1;
+}
+
+/*
+ * Program the data of 'plan', starting from the current contents 'cur', if
+ * known, with a bulk write first when that saves time.
+ */
+static int eeprom_program_image(const struct eeprom_cfg *config,
+				struct xfer_plan *plan, const uint8_t *cur)
+{
+	uint8_t *readback = NULL;
+	int ret;
+
+	if (eeprom_program_bulk(config, plan, cur, &readback) < 0)
+		return EXIT_FAILURE;
+
+	/* After a bulk write, it already reported what it set. */
+	ret = eeprom_program_array(config->eeprom, plan,
+				   readback ? readback : cur, !readback);
+	free(readback);
+
+	return ret;
+}
+
+/*
+ * List words where 'readback' differs from 'data', out of those set in
+ * 'dirty', if given. Returns their number.
+ */
+static size_t print_mismatch_map(const struct eeprom *eeprom,
+				 const uint8_t *data, const uint8_t *dirty,
+				 const uint8_t *readback)
+{
+	const size_t step = (eeprom->is_x16) ? 2 : 1;
+	size_t i, nr_bad = 0;
+
+	for (i = 0; i < eeprom->size; i += step) {
+		if (dirty && !dirty[i])
+			continue;
+
+		if (!memcmp(data + i, readback + i, step))
+			continue;
+
+		if (nr_bad++ >= VERIFY_MAP_MAX)
+			continue;
+
+		if (step == 2)
+			fprintf(stderr, "  0x%03zx: expected %02x%02x, read %02x%02x\n",
+				i / step, data[i], data[i + 1],
+				readback[i], readback[i + 1]);
+		else
+			fprintf(stderr, "  0x%03zx: expected %02x, read %02x\n",
+				i, data[i], readback[i]);
+	}
+
+	if (nr_bad > VERIFY_MAP_MAX)
+		fprintf(stderr, "  ... and %zu more\n", nr_bad - VERIFY_MAP_MAX);
+
+	return nr_bad;
+}
+
+/*
+ * Read back the whole array and compare it against the data of 'plan'. Words
+ * which don't match are rewritten, and checked again, up to VERIFY_RETRIES
+ * times.
+ */
+static int eeprom_verify(const struct eeprom_cfg *config,
+			 struct xfer_plan *plan)
+{
+	const struct eeprom *eeprom = config->eeprom;
+	const uint8_t *data = plan->buf;
+	uint8_t *readback;
+	size_t i, nr_bad, nr_bytes = eeprom->size;
+	int attempt, ret = EXIT_FAILURE;
+
+	readback = malloc(eeprom->size);
+	if (!readback) {
+		perror("Could not allocate verify buffer");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; plan->dirty && i < eeprom->size; i++)
+		nr_bytes -= !plan->dirty[i];
+
+	for (attempt = 0; ; attempt++) {
+		if (read_array(config, readback) < 0) {
+			perror("Could not execute SPI transaction (verify)");
+			break;
+		}
+
+		nr_bad = print_mismatch_map(eeprom, data, plan->dirty,
+					    readback);
+		if (!nr_bad) {
+			printf("Verified %zu bytes\n", nr_bytes);
+			ret = EXIT_SUCCESS;
+			break;
+		}
+
+		if (attempt == VERIFY_RETRIES) {
+			fprintf(stderr, "Verification failed: %zu words differ\n",
+				nr_bad);
+			break;
+		}
+
+		printf("Rewriting %zu mismatching words\n", nr_bad);
+		eeprom_program_array(eeprom, plan, readback, false);
+	}
+
+	free(readback);
+	return ret;
+}
+
+/* Parse 'nr' bytes, written as pairs of hex digits, from 'str'. */
+static int parse_hex_bytes(const char *str, uint8_t *bytes, size_t nr)
+{
+	char digits[3] = { 0 };
+	char *end;
+	size_t i;
+
+	for (i = 0; i < nr; i++) {
+		digits[0] = str[2 * i];
+		digits[1] = digits[0] ? str[2 * i + 1] : '\0';
+		bytes[i] = strtoul(digits, &end, 16);
+		if (!isxdigit(digits[0]) || !isxdigit(digits[1]) || *end)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Set byte 'addr' of the image. */
+static int image_set(const struct eeprom *eeprom, struct eeprom_image *img,
+		     uint32_t addr, uint8_t value)
+{
+	if (addr >= eeprom->size)
+		return -1;
+
+	img->data[addr] = value;
+	img->dirty[addr] = 1;
+	return 0;
+}
+
+/*
+ * Read the next record of a text image into 'line', without the line ending.
+ * Blank lines are skipped. Returns false at the end of the file.
+ */
+static bool read_record(FILE *in, char *line, size_t len, unsigned int *lineno)
+{
+	while (fgets(line, len, in)) {
+		(*lineno)++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0])
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Intel HEX: ":LLAAAATT<data>CC" records, with LL data bytes at address
+ * AAAA, record type TT, and a checksum which makes all the bytes sum to zero.
+ * Extended segment (02) and linear (04) address records set the upper address
+ * bits of the data records that follow.
+ */
+static int ihex_load(const struct eeprom *eeprom, FILE *in, const char *path,
+		     struct eeprom_image *img)
+{
+	char line[1 + 2 * (5 + 255) + 2];
+	uint8_t rec[5 + 255], sum;
+	uint32_t base = 0, addr;
+	unsigned int lineno = 0;
+	size_t len, i;
+
+	while (read_record(in, line, sizeof(line), &lineno)) {
+		len = strlen(line);
+		if (line[0] != ':' || len < 11 || !(len & 1) ||
+		    parse_hex_bytes(line + 1, rec, (len - 1) / 2) < 0 ||
+		    (size_t)rec[0] + 5 != (len - 1) / 2) {
+			fprintf(stderr, "%s:%u: malformed record\n", path, lineno);
+			return -1;
+		}
+
+		for (i = 0, sum = 0; i < rec[0] + 5u; i++)
+			sum += rec[i];
+		if (sum) {
+			fprintf(stderr, "%s:%u: bad checksum\n", path, lineno);
+			return -1;
+		}
+
+		addr = base + (rec[1] << 8 | rec[2]);
+		switch (rec[3]) {
+		case 0x00:
+			for (i = 0; i < rec[0]; i++) {
+				if (image_set(eeprom, img, addr + i,
+					      rec[4 + i]) < 0) {
+					fprintf(stderr, "%s:%u: address 0x%zx is "
+						"outside the EEPROM\n", path,
+						lineno, addr + i);
+					return -1;
+				}
+			}
+			break;
+		case 0x01:
+			return 0;
+		case 0x02:
+		case 0x04:
+			if (rec[0] != 2) {
+				fprintf(stderr, "%s:%u: malformed record\n",
+					path, lineno);
+				return -1;
+			}
+			base = (rec[4] << 8 | rec[5]) << (rec[3] == 0x02 ? 4 : 16);
+			break;
+		case 0x03:
+		case 0x05:
+			/* Start address, meaningless for an EEPROM. */
+			break;
+		default:
+			fprintf(stderr, "%s:%u: unknown record type %02x\n",
+				path, lineno, rec[3]);
+			return -1;
+		}
+	}
+
+	fprintf(stderr, "%s: no end of file record\n", path);
+	return -1;
+}
+
+static int ihex_save(const struct eeprom *eeprom, FILE *out,
+		     const uint8_t *data, size_t offset, size_t length)
+{
+	const size_t end = offset + length;
+	size_t addr, i, len;
+	uint8_t sum;
+
+	(void)eeprom;
+
+	for (addr = offset; addr < end; addr += len) {
+		len = end - addr < 16 ? end - addr : 16;
+		sum = len + (addr >> 8) + addr;
+		fprintf(out, ":%02zX%04zX00", len, addr);
+		for (i = 0; i < len; i++) {
+			fprintf(out, "%02X", data[addr + i]);
+			sum += data[addr + i];
+		}
+		fprintf(out, "%02X\n", (uint8_t)-sum);
+	}
+
+	fprintf(out, ":00000001FF\n");
+	return 0;
+}
+
+/*
+ * Motorola S-record: "STLL<address><data>CC", where T is the record type,
+ * LL counts the address, data and checksum bytes, and the checksum is the
+ * ones' complement of their sum. S1, S2 and S3 carry data, with 2, 3 and 4
+ * byte addresses. S7, S8 and S9 end the file.
+ */
+static int srec_load(const struct eeprom *eeprom, FILE *in, const char *path,
+		     struct eeprom_image *img)
+{
+	static const uint8_t addr_len[10] = { 2, 2, 3, 4, 0, 2, 3, 4, 3, 2 };
+	char line[4 + 2 * 255 + 2];
+	uint8_t rec[1 + 255], sum;
+	unsigned int lineno = 0, type;
+	uint32_t addr;
+	size_t len, i, alen;
+
+	while (read_record(in, line, sizeof(line), &lineno)) {
+		len = strlen(line);
+		type = line[1] - '0';
+		if (line[0] != 'S' || type > 9 || type == 4 || len < 4 ||
+		    (len & 1) || parse_hex_bytes(line + 2, rec, len / 2 - 1) < 0 ||
+		    rec[0] + 1u != len / 2 - 1 || rec[0] < addr_len[type] + 1) {
+			fprintf(stderr, "%s:%u: malformed record\n", path, lineno);
+			return -1;
+		}
+
+		for (i = 0, sum = 0; i < rec[0] + 1u; i++)
+			sum += rec[i];
+		if (sum != 0xff) {
+			fprintf(stderr, "%s:%u: bad checksum\n", path, lineno);
+			return -1;
+		}
+
+		if (type >= 7)
+			return 0;
+		if (type == 0 || type > 3)
+			continue;
+
+		alen = addr_len[type];
+		for (i = 0, addr = 0; i < alen; i++)
+			addr = addr << 8 | rec[1 + i];
+
+		for (i = 0; i < rec[0] - alen - 1u; i++) {
+			if (image_set(eeprom, img, addr + i,
+				      rec[1 + alen + i]) < 0) {
+				fprintf(stderr, "%s:%u: address 0x%zx is outside "
+					"the EEPROM\n", path, lineno, addr + i);
+				return -1;
+			}
+		}
+	}
+
+	fprintf(stderr, "%s: no termination record\n", path);
+	return -1;
+}
+
+static int srec_save(const struct eeprom *eeprom, FILE *out,
+		     const uint8_t *data, size_t offset, size_t length)
+{
+	const size_t end = offset + length;
+	size_t addr, i, len;
+	uint8_t sum;
+
+	(void)eeprom;
+
+	fprintf(out, "S0030000FC\n");
+
+	for (addr = offset; addr < end; addr += len) {
+		len = end - addr < 16 ? end - addr : 16;
+		sum = (len + 3) + (addr >> 8) + addr;
+		fprintf(out, "S1%02zX%04zX", len + 3, addr);
+		for (i = 0; i < len; i++) {
+			fprintf(out, "%02X", data[addr + i]);
+			sum += data[addr + i];
+		}
+		fprintf(out, "%02X\n", (uint8_t)~sum);
+	}
+
+	fprintf(out, "S9030000FC\n");
+	return 0;
+}
+
+/*
+ * Sparse: one "address:value" line per word, with word addresses and values,
+ * in C notation (0x for hex). Everything after a '#' is a comment.
+ */
+static int sparse_load(const struct eeprom *eeprom, FILE *in, const char *path,
+		       struct eeprom_image *img)
+{
+	const size_t step = eeprom->is_x16 ? 2 : 1;
+	char line[256], *str, *end, *sep;
+	unsigned long addr, value;
+	unsigned int lineno = 0;
+
+	while (read_record(in, line, sizeof(line), &lineno)) {
+		line[strcspn(line, "#")] = '\0';
+		for (str = line; isspace(*str); str++)
+			;
+		if (!*str)
+			continue;
+
+		addr = strtoul(str, &end, 0);
+		sep = end + strspn(end, " \t");
+		if (end == str || *sep != ':') {
+			fprintf(stderr, "%s:%u: expected address:value\n",
+				path, lineno);
+			return -1;
+		}
+
+		str = sep + 1;
+		value = strtoul(str, &end, 0);
+		while (isspace(*end))
+			end++;
+		if (end == str || *end || value >> (8 * step)) {
+			fprintf(stderr, "%s:%u: bad value\n", path, lineno);
+			return -1;
+		}
+
+		if (addr >= eeprom->size / step) {
+			fprintf(stderr, "%s:%u: word 0x%lx is outside the "
+				"EEPROM\n", path, lineno, addr);
+			return -1;
+		}
+
+		if (step == 2)
+			image_set(eeprom, img, 2 * addr, value >> 8);
+		image_set(eeprom, img, step * addr + step - 1, value);
+	}
+
+	return 0;
+}
+
+static int sparse_save(const struct eeprom *eeprom, FILE *out,
+		       const uint8_t *data, size_t offset, size_t length)
+{
+	size_t i;
+
+	for (i = offset; i < offset + length; i += eeprom->is_x16 ? 2 : 1) {
+		if (eeprom->is_x16)
+			fprintf(out, "0x%03zx:0x%02x%02x\n", i / 2, data[i],
+				data[i + 1]);
+		else
+			fprintf(out, "0x%03zx:0x%02x\n", i, data[i]);
+	}
+
+	return 0;
+}
+
+static const struct image_format image_formats[] = {
+	{ .name = "raw", .extensions = "" },
+	{ .name = "ihex", .extensions = ".hex.ihex.ihx",
+	  .load = ihex_load, .save = ihex_save },
+	{ .name = "srec", .extensions = ".srec.s19.s28.s37.mot",
+	  .load = srec_load, .save = srec_save },
+	{ .name = "sparse", .extensions = ".sparse",
+	  .load = sparse_load, .save = sparse_save },
+	{ .name = NULL },
+};
+
+static const struct image_format *image_format_find(const char *name)
+{
+	const struct image_format *format;
+
+	for (format = image_formats; format->name; format++) {
+		if (!strcasecmp(format->name, name))
+			return format;
+	}
+
+	return NULL;
+}
+
+/* The format of 'config->filename': as given, or from its extension. */
+static const struct image_format *
+image_format_of(const struct eeprom_cfg *config)
+{
+	const struct image_format *format;
+	const char *ext, *known;
+	size_t len, known_len;
+
+	if (config->format)
+		return config->format;
+
+	ext = strrchr(config->filename, '.');
+	if (!ext || strchr(ext, '/'))
+		return image_formats;
+
+	len = strlen(ext);
+	for (format = image_formats; format->name; format++) {
+		for (known = format->extensions; *known; known += known_len) {
+			known_len = strcspn(known + 1, ".") + 1;
+			if (known_len == len && !strncasecmp(known, ext, len))
+				return format;
+		}
+	}
+
+	return image_formats;
+}
+
+static void unload_image(const struct eeprom_cfg *config,
+			 struct eeprom_image *img)
+{
+	if (img->mapped)
+		munmap(img->data, config->eeprom->size);
+	else
+		free(img->data);
+	free(img->dirty);
+	memset(img, 0, sizeof(*img));
+}
+
+/* Read a raw image of part of the array into an image of the whole. */
+static int load_raw_range(const struct eeprom_cfg *config, int fd,
+			  struct eeprom_image *img)
+{
+	const size_t length = range_length(config);
+
+	img->data = malloc(config->eeprom->size);
+	img->dirty = calloc(config->eeprom->size, 1);
+	if (!img->data || !img->dirty) {
+		perror("Could not allocate image buffer");
+		unload_image(config, img);
+		return -1;
+	}
+
+	memset(img->data, 0xff, config->eeprom->size);
+	memset(img->dirty + config->offset, 1, length);
+
+	if (pread(fd, img->data + config->offset, length, 0) != (ssize_t)length) {
+		fprintf(stderr, "Failed to read contents of %s!\n",
+			config->filename);
+		unload_image(config, img);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Map a raw image. The write transfers point straight into the mapping.
+ * With --offset or --length, the file only holds the selected part.
+ */
+static int load_raw_image(const struct eeprom_cfg *config,
+			  struct eeprom_image *img)
+{
+	const size_t length = range_length(config);
+	struct stat st;
+	void *buf;
+	int fd, ret;
+
+	fd = open(config->filename, O_RDONLY);
+	if (fd < 0) {
+		perror("Could not open input file.");
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		perror("Could not stat input file");
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_size != (off_t)length) {
+		fprintf(stderr, "File size does not match %s size!\n",
+			length == config->eeprom->size ? "EEPROM" : "range");
+		close(fd);
+		return -1;
+	}
+
+	if (length != config->eeprom->size) {
+		ret = load_raw_range(config, fd, img);
+		close(fd);
+		return ret;
+	}
+
+	buf = mmap(NULL, config->eeprom->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (buf == MAP_FAILED) {
+		fprintf(stderr, "Failed to map contents of %s: %s\n",
+			config->filename, strerror(errno));
+		return -1;
+	}
+
+	img->data = buf;
+	img->dirty = NULL;
+	img->mapped = true;
+	return 0;
+}
+
+
+/*
+ * Templates patch a copy of the image, which is then written whole, so the
+ * image must cover the whole array. Unload it if it doesn't.
+ */
+static int check_template_image(const struct eeprom_cfg *config,
+				struct eeprom_image *img)
+{
+	if (config->tmpl && img->dirty) {
+		fprintf(stderr, "%s: templates need an image of the whole "
+			"EEPROM\n", config->filename);
+		unload_image(config, img);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Load the image to write from 'config->filename'. Raw images cover the whole
+ * array, while other formats only set the words they have records for.
+ */
+static int load_image(const struct eeprom_cfg *config,
+		      struct eeprom_image *img)
+{
+	const struct eeprom *eeprom = config->eeprom;
+	const struct image_format *format = image_format_of(config);
+	size_t i;
+	FILE *in;
+	int ret;
+
+	memset(img, 0, sizeof(*img));
+	if (!format->load) {
+		if (load_raw_image(config, img) < 0)
+			return -1;
+		return check_template_image(config, img);
+	}
+
+	in = fopen(config->filename, "r");
+	if (!in) {
+		perror("Could not open input file.");
+		return -1;
+	}
+
+	img->data = malloc(eeprom->size);
+	img->dirty = calloc(eeprom->size, 1);
+	if (!img->data || !img->dirty) {
+		perror("Could not allocate image buffer");
+		fclose(in);
+		unload_image(config, img);
+		return -1;
+	}
+
+	/* What untouched words hold doesn't matter, as they aren't written. */
+	memset(img->data, 0xff, eeprom->size);
+
+	ret = format->load(eeprom, in, config->filename, img);
+	fclose(in);
+	if (ret < 0) {
+		unload_image(config, img);
+		return -1;
+	}
+
+	/* Leave out what is outside the selected range. */
+	memset(img->dirty, 0, config->offset);
+	memset(img->dirty + config->offset + range_length(config), 0,
+	       eeprom->size - config->offset - range_length(config));
+
+	/* Words are written whole, so both bytes of an x16 word must be set. */
+	for (i = 0; eeprom->is_x16 && i < eeprom->size; i += 2) {
+		if (img->dirty[i] != img->dirty[i + 1]) {
+			fprintf(stderr, "%s: only one byte of word 0x%03zx is "
+				"set\n", config->filename, i / 2);
+			unload_image(config, img);
+			return -1;
+		}
+	}
+
+	/* An image which sets every word may as well be raw. */
+	if (!memchr(img->dirty, 0, eeprom->size)) {
+		free(img->dirty);
+		img->dirty = NULL;
+	}
+
+	return check_template_image(config, img);
+}
+
+static const char *const checksum_names[] = {
+	[CSUM_SUM8] = "sum8",
+	[CSUM_XOR8] = "xor8",
+	[CSUM_SUM16] = "sum16",
+	[CSUM_CRC16] = "crc16-ccitt",
+	[CSUM_CRC32] = "crc32",
+};
+
+/* Parse a value from a list: a number, or hex bytes separated by colons. */
+static int parse_list_value(const char *str, uint64_t *value)
+{
+	char digits[32];
+	char *end;
+	size_t i, len = 0;
+
+	if (!strchr(str, ':')) {
+		*value = strtoull(str, &end, 0);
+		return (end == str || *end) ? -1 : 0;
+	}
+
+	for (i = 0; str[i]; i++) {
+		if (str[i] == ':')
+			continue;
+		if (len == sizeof(digits) - 1)
+			return -1;
+		digits[len++] = str[i];
+	}
+
+	digits[len] = '\0';
+	*value = strtoull(digits, &end, 16);
+	return (!len || *end) ? -1 : 0;
+}
+
+static int template_load_list(struct template_field *field, const char *path)
+{
+	char line[128], *str;
+	unsigned int lineno = 0;
+	uint64_t *list;
+	FILE *in;
+
+	in = fopen(path, "r");
+	if (!in) {
+		perror("Could not open template list");
+		return -1;
+	}
+
+	while (read_record(in, line, sizeof(line), &lineno)) {
+		line[strcspn(line, "#")] = '\0';
+		for (str = line; isspace(*str); str++)
+			;
+		str[strcspn(str, " \t")] = '\0';
+		if (!*str)
+			continue;
+
+		list = realloc(field->list, (field->list_len + 1) *
+			       sizeof(*list));
+		if (!list) {
+			perror("Could not allocate template list");
+			fclose(in);
+			return -1;
+		}
+
+		field->list = list;
+		if (parse_list_value(str, &list[field->list_len]) < 0) {
+			fprintf(stderr, "%s:%u: bad value\n", path, lineno);
+			fclose(in);
+			return -1;
+		}
+		field->list_len++;
+	}
+
+	fclose(in);
+	return 0;
+}
+
+/* Parse the source of a field: "counter:", "list:" or "checksum:". */
+static int template_parse_source(struct template_field *field, char *source)
+{
+	char *arg, *end, *target;
+	size_t i;
+
+	arg = strchr(source, ':');
+	if (!arg)
+		return -1;
+	*arg++ = '\0';
+
+	if (!strcmp(source, "counter")) {
+		field->source = FIELD_COUNTER;
+		field->start = strtoull(arg, &end, 0);
+		field->step = 1;
+		if (*end == ':')
+			field->step = strtoull(end + 1, &end, 0);
+		return (*end) ? -1 : 0;
+	}
+
+	if (!strcmp(source, "list")) {
+		field->source = FIELD_LIST;
+		return template_load_list(field, arg);
+	}
+
+	if (strcmp(source, "checksum"))
+		return -1;
+
+	field->source = FIELD_CHECKSUM;
+	end = strchr(arg, ':');
+	if (!end)
+		return -1;
+	*end++ = '\0';
+
+	target = strchr(arg, '=');
+	if (target) {
+		*target++ = '\0';
+		field->has_target = true;
+		field->target = strtoull(target, NULL, 0);
+	}
+
+	for (i = 0; i < sizeof(checksum_names) / sizeof(checksum_names[0]); i++) {
+		if (!strcasecmp(arg, checksum_names[i]))
+			break;
+	}
+	if (i == sizeof(checksum_names) / sizeof(checksum_names[0]))
+		return -1;
+	field->algo = i;
+
+	if (field->has_target && field->algo != CSUM_SUM8 &&
+	    field->algo != CSUM_SUM16)
+		return -1;
+
+	field->range_start = strtoul(end, &end, 0);
+	if (*end++ != '-')
+		return -1;
+	field->range_end = strtoul(end, &end, 0);
+	if (*end || field->range_end < field->range_start)
+		return -1;
+
+	return 0;
+}
+
+static void template_free(struct template *tmpl)
+{
+	size_t i;
+
+	for (i = 0; i < tmpl->nr_fields; i++)
+		free(tmpl->fields[i].list);
+	tmpl->nr_fields = 0;
+}
+
+/*
+ * Load a personalization template. Each line defines a field:
+ *   <name> <offset> <width> <source> [be|le]
+ * where the source is "counter:<start>[:<step>]", "list:<file>", or
+ * "checksum:<algo>[=<target>]:<first>-<last>".
+ */
+static int template_load(const struct eeprom *eeprom, const char *path,
+			 struct template *tmpl)
+{
+	char line[512], name[32], source[256], order[8];
+	unsigned int lineno = 0;
+	struct template_field *field;
+	long offset, width;
+	int nr;
+	FILE *in;
+
+	in = fopen(path, "r");
+	if (!in) {
+		perror("Could not open template");
+		return -1;
+	}
+
+	memset(tmpl, 0, sizeof(*tmpl));
+	while (read_record(in, line, sizeof(line), &lineno)) {
+		line[strcspn(line, "#")] = '\0';
+		order[0] = '\0';
+		nr = sscanf(line, "%31s %li %li %255s %7s", name, &offset,
+			    &width, source, order);
+		if (nr <= 0)
+			continue;
+
+		if (tmpl->nr_fields == TEMPLATE_MAX_FIELDS) {
+			fprintf(stderr, "%s:%u: too many fields\n", path, lineno);
+			goto err;
+		}
+
+		field = &tmpl->fields[tmpl->nr_fields++];
+		snprintf(field->name, sizeof(field->name), "%s", name);
+		field->offset = offset;
+		field->width = width;
+
+		if (nr < 4 || (order[0] && strcmp(order, "be") &&
+			       strcmp(order, "le"))) {
+			fprintf(stderr, "%s:%u: expected <name> <offset> "
+				"<width> <source> [be|le]\n", path, lineno);
+			goto err;
+		}
+		field->little_endian = !strcmp(order, "le");
+
+		if (offset < 0 || width <= 0 || width > (long)sizeof(uint64_t) ||
+		    offset + width > eeprom->size) {
+			fprintf(stderr, "%s:%u: field does not fit the EEPROM\n",
+				path, lineno);
+			goto err;
+		}
+
+		if (template_parse_source(field, source) < 0) {
+			fprintf(stderr, "%s:%u: bad source\n", path, lineno);
+			goto err;
+		}
+
+		if (field->source == FIELD_CHECKSUM &&
+		    (field->range_end >= eeprom->size ||
+		     (field->algo == CSUM_SUM16 &&
+		      (field->range_end - field->range_start) % 2 == 0))) {
+			fprintf(stderr, "%s:%u: bad checksum range\n", path,
+				lineno);
+			goto err;
+		}
+	}
+
+	fclose(in);
+	return 0;
+
+err:
+	fclose(in);
+	template_free(tmpl);
+	return -1;
+}
+
+static uint64_t field_load(const struct template_field *field,
+			   const uint8_t *data, size_t offset, size_t width)
+{
+	uint64_t value = 0;
+	size_t i;
+
+	for (i = 0; i < width; i++) {
+		value <<= 8;
+		value |= data[offset + (field->little_endian ? width - 1 - i : i)];
+	}
+
+	return value;
+}
+
+static void field_store(const struct template_field *field, uint8_t *data,
+			uint64_t value)
+{
+	size_t i;
+
+	for (i = 0; i < field->width; i++) {
+		data[field->offset + (field->little_endian ? i :
+				      field->width - 1 - i)] = value;
+		value >>= 8;
+	}
+}
+
+/* Checksum of the range of 'field', with the field itself taken as zero. */
+static uint64_t field_checksum(const struct template_field *field,
+			       uint8_t *data)
+{
+	uint64_t sum = 0;
+	uint32_t crc;
+	size_t i;
+	int bit;
+
+	field_store(field, data, 0);
+
+	switch (field->algo) {
+	case CSUM_SUM8:
+		for (i = field->range_start; i <= field->range_end; i++)
+			sum += data[i];
+		return sum & 0xff;
+	case CSUM_XOR8:
+		for (i = field->range_start; i <= field->range_end; i++)
+			sum ^= data[i];
+		return sum;
+	case CSUM_SUM16:
+		for (i = field->range_start; i < field->range_end; i += 2)
+			sum += field_load(field, data, i, 2);
+		return sum & 0xffff;
+	case CSUM_CRC16:
+		/* CCITT polynomial, initial value 0xffff, MSB first. */
+		for (crc = 0xffff, i = field->range_start;
+		     i <= field->range_end; i++) {
+			crc ^= data[i] << 8;
+			for (bit = 0; bit < 8; bit++)
+				crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 :
+						       crc << 1;
+		}
+		return crc & 0xffff;
+	case CSUM_CRC32:
+		/* IEEE 802.3, as in zlib. */
+		for (crc = ~0u, i = field->range_start;
+		     i <= field->range_end; i++) {
+			crc ^= data[i];
+			for (bit = 0; bit < 8; bit++)
+				crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320 :
+						  crc >> 1;
+		}
+		return ~crc;
+	}
+
+	return 0;
+}
+
+/*
+ * Personalize 'base' as device number 'index', into 'data'. Counters and
+ * lists are filled in first, so the checksums cover their final values.
+ * Checksums are computed in the order they are defined.
+ */
+static int template_apply(const struct template *tmpl,
+			  const struct eeprom *eeprom, uint8_t *data,
+			  const uint8_t *base, unsigned int index)
+{
+	const struct template_field *field;
+	uint64_t value;
+	size_t i;
+	int pass;
+
+	memcpy(data, base, eeprom->size);
+
+	printf("Device %u:", index);
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < tmpl->nr_fields; i++) {
+			field = &tmpl->fields[i];
+			if ((field->source == FIELD_CHECKSUM) != pass)
+				continue;
+
+			switch (field->source) {
+			case FIELD_COUNTER:
+				value = field->start + field->step * index;
+				break;
+			case FIELD_LIST:
+				if (index >= field->list_len) {
+					printf("\n");
+					fprintf(stderr, "%s: list has no "
+						"entry for device %u\n",
+						field->name, index);
+					return -1;
+				}
+				value = field->list[index];
+				break;
+			default:
+				value = field_checksum(field, data);
+				if (field->has_target)
+					value = field->target - value;
+				break;
+			}
+
+			field_store(field, data, value);
+			printf(" %s=0x%0*llx", field->name,
+			       (int)(2 * field->width),
+			       (unsigned long long)field_load(field, data,
+							      field->offset,
+							      field->width));
+		}
+	}
+	printf("\n");
+
+	return 0;
+}
+
+/*
+ * Program EEPROM. All EEPROMS will erase the word before a write.
+ * With a template, the image is personalized for this device first, in the
+ * buffer the write plan points into.
+ */
+static int eeprom_write(const struct eeprom_cfg *config)
+{
+	uint8_t *cur = NULL;
+	struct eeprom_image local_image = { 0 }, patched = { 0 };
+	const struct eeprom_image *image = config->image;
+	struct xfer_plan plan = { 0 };
+	int ret = EXIT_FAILURE;
+
+	if (!image) {
+		if (load_image(config, &local_image) < 0)
+			return EXIT_FAILURE;
+		image = &local_image;
+	}
+
+	if (config->tmpl) {
+		patched.data = malloc(config->eeprom->size);
+		if (!patched.data) {
+			perror("Could not allocate image buffer");
+			goto out;
+		}
+	}
+
+	if (plan_write(config->eeprom, &plan,
+		       config->tmpl ? &patched : image) < 0) {
+		perror("Could not allocate write plan");
+		goto out;
+	}
+
+	if (config->tmpl && template_apply(config->tmpl, config->eeprom,
+					   plan.buf, image->data,
+					   config->index) < 0)
+		goto out;
+
+	/*
+	 * The shadow cache is only trusted for plain reads. What a diff write
+	 * skips has to be on the device, not just in a copy that matched it.
+	 */
+	if (config->diff_write) {
+		cur = malloc(config->eeprom->size);
+		if (!cur || read_array(config, cur) < 0) {
+			perror("Could not read current EEPROM contents");
+			goto out;
+		}
+	}
+
+	if (enable_write(config->eeprom) < 0) {
+		perror("Could not execute SPI transaction (enable write)");
+		goto out;
+	}
+
+	ret = eeprom_program_image(config, &plan, cur);
+	if (ret == EXIT_SUCCESS && config->verify)
+		ret = eeprom_verify(config, &plan);
+	shadow_written(config, &plan, cur, ret == EXIT_SUCCESS);
+
+out:
+	free(cur);
+	plan_free(&plan);
+	free(patched.data);
+	unload_image(config, &local_image);
+
+	return ret;
+}
+
+/* Compare the EEPROM against the image in 'config->filename'. */
+static int eeprom_check(const struct eeprom_cfg *config)
+{
+	struct eeprom_image image;
+	uint8_t *readback;
+	size_t nr_bad;
+
+	if (load_image(config, &image) < 0)
+		return EXIT_FAILURE;
+
+	readback = malloc(config->eeprom->size);
+	if (!readback || read_array(config, readback) < 0) {
+		perror("Could not read EEPROM contents");
+		free(readback);
+		unload_image(config, &image);
+		return EXIT_FAILURE;
+	}
+
+	nr_bad = print_mismatch_map(config->eeprom, image.data, image.dirty,
+				    readback);
+	if (nr_bad)
+		fprintf(stderr, "%zu words differ\n", nr_bad);
+	else
+		printf("EEPROM matches %s\n", config->filename);
+
+	free(readback);
+	unload_image(config, &image);
+
+	return nr_bad ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Erase the words selected with --offset and --length, one ERASE command
+ * each. Only worth it for a part of the array: ERAL takes as long as a few.
+ */
+static int eeprom_erase_range(const struct eeprom_cfg *config)
+{
+	const struct eeprom *eeprom = config->eeprom;
+	const size_t step = eeprom->is_x16 ? 2 : 1;
+	const size_t first = config->offset / step;
+	const size_t last = first + range_length(config) / step;
+	size_t addr, failed = 0;
+
+	for (addr = first; addr < last; addr++) {
+		if (erase_word(eeprom, addr) < 0) {
+			perror("Could not execute SPI transaction (erase)");
+			return EXIT_FAILURE;
+		}
+
+		if (wait_write_cycle(eeprom) < 0) {
+			fprintf(stderr, "Word 0x%03zx: erase cycle did not "
+				"complete within %u us\n", addr,
+				2 * eeprom->twc_max_us);
+			failed++;
+		}
+	}
+
+	if (failed) {
+		fprintf(stderr, "%zu words failed to erase\n", failed);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* Erase contents of the EEPROM. */
+static int eeprom_erase(const struct eeprom_cfg *config)
+{
+	uint8_t *erased;
+	int ret;
+
+	ret = enable_write(config->eeprom);
+	if (ret < 0) {
+		perror("Could not execute SPI transaction (enable write)");
+		return EXIT_FAILURE;
+	}
+
+	/* Whatever happens next, the cached contents are out of date. */
+	shadow_store(config, NULL);
+
+	if (range_length(config) != config->eeprom->size)
+		return eeprom_erase_range(config);
+
+	ret = erase_all(config->eeprom);
+	if (ret < 0) {
+		perror("Could not execute SPI transaction (erase all)");
+		return EXIT_FAILURE;
+	}
+
+	if (wait_bulk_cycle(config->eeprom) < 0) {
+		fprintf(stderr, "Erase did not complete within %u us\n",
+			BULK_TWC_FACTOR * config->eeprom->twc_max_us);
+		return EXIT_FAILURE;
+	}
+
+	erased = malloc(config->eeprom->size);
+	if (erased) {
+		memset(erased, 0xff, config->eeprom->size);
+		shadow_store(config, erased);
+		free(erased);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Find the file, under the user's cache directory, where the result of
+ * expensive probes is kept between runs. The directory is created if needed.
+ */
+static int cache_file_path(char *path, size_t len, const char *name)
+{
+	const char *base = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	size_t dirlen;
+	int ret;
+
+	/* The base cache directory itself may not exist yet. */
+	if (base && *base) {
+		mkdir(base, 0755);
+		ret = snprintf(path, len, "%s/eeprom-93cx6", base);
+	} else if (home && *home) {
+		snprintf(path, len, "%s/.cache", home);
+		mkdir(path, 0755);
+		ret = snprintf(path, len, "%s/.cache/eeprom-93cx6", home);
+	} else {
+		return -1;
+	}
+
+	if (ret < 0 || (size_t)ret >= len)
+		return -1;
+
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		return -1;
+
+	dirlen = strlen(path);
+	ret = snprintf(path + dirlen, len - dirlen, "/%s", name);
+	if (ret < 0 || (size_t)ret >= len - dirlen)
+		return -1;
+
+	return 0;
+}
+
+/* Look up the SPI clock previously tuned for 'spidev'. Returns 0 if none. */
+static uint32_t speed_cache_load(const char *spidev)
+{
+	char path[PATH_MAX], dev[PATH_MAX];
+	unsigned long hz;
+	uint32_t speed_hz = 0;
+	FILE *f;
+
+	if (cache_file_path(path, sizeof(path), "speed") < 0)
+		return 0;
+
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+
+	while (fscanf(f, "%4095s %lu", dev, &hz) == 2) {
+		if (!strcmp(dev, spidev))
+			speed_hz = hz;
+	}
+
+	fclose(f);
+	return speed_hz;
+}
+
+/* Remember the tuned SPI clock for 'spidev', replacing any older entry. */
+static int speed_cache_store(const char *spidev, uint32_t speed_hz)
+{
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	char path[PATH_MAX], tmp[PATH_MAX + 4], dev[PATH_MAX];
+	unsigned long hz;
+	FILE *in, *out;
+	int ret;
+
+	if (cache_file_path(path, sizeof(path), "speed") < 0)
+		return -1;
+
+	/* Gang workers may tune at the same time. */
+	pthread_mutex_lock(&lock);
+
+	snprintf(tmp, sizeof(tmp), "%s.new", path);
+	out = fopen(tmp, "w");
+	if (!out) {
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
+
+	in = fopen(path, "r");
+	if (in) {
+		while (fscanf(in, "%4095s %lu", dev, &hz) == 2) {
+			if (strcmp(dev, spidev))
+				fprintf(out, "%s %lu\n", dev, hz);
+		}
+		fclose(in);
+	}
+
+	fprintf(out, "%s %lu\n", spidev, (unsigned long)speed_hz);
+	if (fclose(out) != 0)
+		ret = -1;
+	else
+		ret = rename(tmp, path);
+
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+/*
+ * Shadow cache: the last known contents of each device, saved after reads
+ * and writes, so that reads, and the read before a diff write, can be skipped
+ * when the device was programmed by this station. Before a cached copy is
+ * used, a fingerprint of SHADOW_SAMPLES words is read from the device, in one
+ * message, and compared to it: half at fixed spots spread over the array,
+ * and half at random ones, which differ on every check. The file also holds
+ * a hash of the contents, so that a damaged copy is never used.
+ * Verification always reads the device itself.
+ */
+static bool shadow_enabled(const struct eeprom_cfg *config)
+{
+	/* A simulator without a backing file starts out erased every time. */
+	return !config->no_cache && strcmp(config->spidev, "sim");
+}
+
+static int shadow_path(const struct eeprom_cfg *config, char *path, size_t len)
+{
+	char name[NAME_MAX];
+	const char *c;
+	size_t i;
+
+	i = snprintf(name, sizeof(name), "shadow-");
+	for (c = config->spidev; *c && i + 1 < sizeof(name); c++)
+		name[i++] = (isalnum((unsigned char)*c) || *c == '.' ||
+			     *c == '-') ? *c : '_';
+	name[i] = '\0';
+
+	return cache_file_path(path, len, name);
+}
+
+/* FNV-1a, which is plenty to catch a truncated or damaged file. */
+static uint64_t shadow_hash(const uint8_t *data, size_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+/* Read the sampled words from the device, and compare them to 'data'. */
+static bool shadow_fingerprint_ok(const struct eeprom *eeprom,
+				  const uint8_t *data)
+{
+	const size_t step = eeprom->is_x16 ? 2 : 1;
+	const size_t nr_words = eeprom->size / step;
+	const uint8_t (*hdrs)[2] = cmd_table(eeprom)->read;
+	struct spi_ioc_transfer xfer[2 * SHADOW_SAMPLES];
+	uint8_t words[SHADOW_SAMPLES][2];
+	size_t addr[SHADOW_SAMPLES], i;
+	unsigned int seed = now_us() ^ getpid();
+
+	for (i = 0; i < SHADOW_SAMPLES; i++) {
+		if (i % 2)
+			addr[i] = rand_r(&seed) % nr_words;
+		else
+			addr[i] = (i / 2) * (nr_words - 1) /
+				  (SHADOW_SAMPLES / 2 - 1);
+
+		prepare_hdr(eeprom, &xfer[2 * i],
+			    hdrs[cmd_addr(eeprom, addr[i])]);
+
+		memset(&xfer[2 * i + 1], 0, sizeof(xfer[0]));
+		xfer[2 * i + 1].rx_buf = (uintptr_t)words[i];
+		xfer[2 * i + 1].len = step;
+		xfer[2 * i + 1].bits_per_word = 8;
+		xfer[2 * i + 1].speed_hz = eeprom->speed_hz;
+		xfer[2 * i + 1].cs_change = (i + 1 < SHADOW_SAMPLES);
+	}
+
+	if (spi_transfer(eeprom, STATS_READ, xfer, 2 * SHADOW_SAMPLES) < 0)
+		return false;
+
+	for (i = 0; i < SHADOW_SAMPLES; i++) {
+		if (memcmp(words[i], data + addr[i] * step, step))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Load the cached contents of the device into 'data', if there are any, and
+ * the device still matches them. Returns 0 if so, or -1.
+ */
+static int shadow_load(const struct eeprom_cfg *config, uint8_t *data)
+{
+	const struct eeprom *eeprom = config->eeprom;
+	char path[PATH_MAX], line[2 * PATH_MAX], dev[PATH_MAX], name[64];
+	unsigned int size, addr_bits;
+	unsigned long long hash;
+	int x16;
+	bool ok;
+	FILE *f;
+
+	if (!shadow_enabled(config) ||
+	    shadow_path(config, path, sizeof(path)) < 0)
+		return -1;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	ok = fgets(line, sizeof(line), f) &&
+	     sscanf(line, "%4095s %63s %u %u %d %llx", dev, name, &size,
+		    &addr_bits, &x16, &hash) == 6 &&
+	     !strcmp(dev, config->spidev) && !strcmp(name, eeprom->name) &&
+	     size == eeprom->size && addr_bits == eeprom->addr_bits &&
+	     x16 == eeprom->is_x16 &&
+	     fread(data, 1, eeprom->size, f) == eeprom->size &&
+	     shadow_hash(data, eeprom->size) == hash;
+	fclose(f);
+
+	if (!ok)
+		return -1;
+
+	if (!shadow_fingerprint_ok(eeprom, data)) {
+		printf("Shadow cache of %s is stale\n", config->spidev);
+		return -1;
+	}
+
+	printf("Using cached contents of %s, fingerprint matched\n",
+	       config->spidev);
+	return 0;
+}
+
+/* Save 'data' as the contents of the device, or forget them if NULL. */
+static void shadow_store(const struct eeprom_cfg *config, const uint8_t *data)
+{
+	const struct eeprom *eeprom = config->eeprom;
+	char path[PATH_MAX], tmp[PATH_MAX + 4];
+	FILE *f;
+	bool ok;
+
+	if (!shadow_enabled(config) ||
+	    shadow_path(config, path, sizeof(path)) < 0)
+		return;
+
+	if (!data) {
+		unlink(path);
+		return;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.new", path);
+	f = fopen(tmp, "w");
+	if (!f)
+		return;
+
+	ok = fprintf(f, "%s %s %u %u %d %016llx\n", config->spidev,
+		     eeprom->name, eeprom->size, eeprom->addr_bits,
+		     eeprom->is_x16,
+		     (unsigned long long)shadow_hash(data, eeprom->size)) > 0 &&
+	     fwrite(data, 1, eeprom->size, f) == eeprom->size;
+
+	if (fclose(f) != 0 || !ok || rename(tmp, path) < 0) {
+		unlink(tmp);
+		/* Better no cache than a stale one. */
+		unlink(path);
+	}
+}
+
+/*
+ * Record the contents after writing 'plan' over 'cur', the previous contents,
+ * if known. If the write failed, or the words outside the image aren't known,
+ * the entry is dropped.
+ */
+static void shadow_written(const struct eeprom_cfg *config,
+			   const struct xfer_plan *plan, const uint8_t *cur,
+			   bool ok)
+{
+	const struct eeprom *eeprom = config->eeprom;
+	const uint8_t *data = plan->buf;
+	uint8_t *merged;
+	size_t i;
+
+	if (!ok || (plan->dirty && !cur)) {
+		shadow_store(config, NULL);
+		return;
+	}
+
+	if (!plan->dirty) {
+		shadow_store(config, data);
+		return;
+	}
+
+	merged = malloc(eeprom->size);
+	if (merged) {
+		for (i = 0; i < eeprom->size; i++)
+			merged[i] = plan->dirty[i] ? data[i] : cur[i];
+	}
+
+	shadow_store(config, merged);
+	free(merged);
+}
+
+/*
+ * Find the fastest SPI clock at which the EEPROM reads back reliably.
+ * The array is first read at a safe clock to get a reference pattern. The
+ * clock is then ramped up, and every rate must reproduce the reference twice
+ * in a row. The fastest rate that does wins.
+ */
+static int eeprom_tune_speed(struct eeprom *eeprom)
+{
+	uint8_t *ref, *buf;
+	uint32_t max_hz = 0, best_hz = SPI_SAFE_SPEED_HZ;
+	struct xfer_plan plan = { 0 };
+	const size_t step = eeprom->is_x16 ? 2 : 1;
+	const size_t nr_words = eeprom->size / step;
+	size_t i, pass;
+	int ret = -1;
+
+	ref = malloc(eeprom->size);
+	buf = malloc(eeprom->size);
+	if (!ref || !buf || plan_read(eeprom, &plan, buf) < 0)
+		goto out;
+
+	if (eeprom->transport->max_speed_hz)
+		max_hz = eeprom->transport->max_speed_hz(eeprom);
+
+	eeprom->speed_hz = SPI_SAFE_SPEED_HZ;
+	if (read_words(eeprom, ref, 0, nr_words) < 0) {
+		perror("Could not execute SPI transaction (speed tune)");
+		goto out;
+	}
+
+	for (i = 1; i < eeprom->size && ref[i] == ref[0]; i++)
+		;
+	if (i == eeprom->size)
+		fprintf(stderr, "Warning: EEPROM contents are uniform. Speed "
+			"tuning may not catch all errors.\n");
+
+	for (i = 1; i < sizeof(tune_speeds_hz) / sizeof(tune_speeds_hz[0]); i++) {
+		if (max_hz && tune_speeds_hz[i] > max_hz)
+			break;
+
+		eeprom->speed_hz = tune_speeds_hz[i];
+		for (pass = 0; pass < 2; pass++) {
+			if (plan_submit(eeprom, &plan, 0, nr_words) < 0)
+				break;
+			if (memcmp(ref, buf, eeprom->size))
+				break;
+		}
+
+		if (pass != 2)
+			break;
+
+		best_hz = tune_speeds_hz[i];
+	}
+
+	eeprom->speed_hz = best_hz;
+	ret = 0;
+out:
+	plan_free(&plan);
+	free(ref);
+	free(buf);
+	return ret;
+}
+
+/* Find out how many bytes spidev accepts in a single message. */
+static size_t spidev_bufsiz(void)
+{
+	FILE *f;
+	unsigned long bufsiz;
+
+	f = fopen(SPIDEV_BUFSIZ_PATH, "r");
+	if (!f)
+		return SPIDEV_DEFAULT_BUFSIZ;
+
+	if (fscanf(f, "%lu", &bufsiz) != 1 || bufsiz == 0)
+		bufsiz = SPIDEV_DEFAULT_BUFSIZ;
+
+	fclose(f);
+	return bufsiz;
+}
+
+/* Open and configure SPI master. Failures are left in errno. */
+static int init_spi_master(const char *spidev)
+{
+	int spif, ret, err;
+	/* Mode 0, but with CS active-high */
+	int mode = SPI_MODE_0 | SPI_CS_HIGH;
+
+	spif = open(spidev, O_RDWR);
+	if (spif < 0)
+		return -1;
+
+	ret = ioctl(spif, SPI_IOC_WR_MODE, &mode);
+	if (ret < 0) {
+		err = errno;
+		close(spif);
+		errno = err;
+		return -1;
+	}
+
+	return spif;
+}
+
+static int spidev_open(struct eeprom *eeprom, const char *path)
+{
+	eeprom->spi_fd = init_spi_master(path);
+	if (eeprom->spi_fd < 0)
+		return -1;
+
+	eeprom->bufsiz = spidev_bufsiz();
+	return 0;
+}
+
+/* Ask the controller to set up 'bits' bit words, then go back to bytes. */
+static bool spidev_supports_bits(const struct eeprom *eeprom, uint8_t bits)
+{
+	uint8_t byte = 8;
+	bool ok;
+
+	ok = ioctl(eeprom->spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits) == 0;
+	ioctl(eeprom->spi_fd, SPI_IOC_WR_BITS_PER_WORD, &byte);
+
+	return ok;
+}
+
+static int spidev_close(struct eeprom *eeprom)
+{
+	int ret;
+
+	ret = close(eeprom->spi_fd);
+	eeprom->spi_fd = -1;
+	return ret;
+}
+
+static int spidev_transfer(const struct eeprom *eeprom,
+			   struct spi_ioc_transfer *xfer, unsigned int nr_xfers)
+{
+	return ioctl(eeprom->spi_fd, SPI_IOC_MESSAGE(nr_xfers), xfer);
+}
+
+static uint32_t spidev_max_speed_hz(const struct eeprom *eeprom)
+{
+	uint32_t max_hz = 0;
+
+	ioctl(eeprom->spi_fd, SPI_IOC_RD_MAX_SPEED_HZ, &max_hz);
+	return max_hz;
+}
+
+static const struct spi_transport spidev_transport = {
+	.name = "spidev",
+	.open = spidev_open,
+	.close = spidev_close,
+	.transfer = spidev_transfer,
+	.max_speed_hz = spidev_max_speed_hz,
+	.supports_bits = spidev_supports_bits,
+};
+
+/*
+ * Software model of a 93Cxx chip, used in place of a real spidev. It decodes
+ * the bit stream the same way the silicon does: wait for a start bit, then
+ * take two opcode bits and 'addr_bits' address bits. Reads clock out a dummy
+ * zero, then data, auto-incrementing through the array. Writes and erases
+ * only take effect while enabled with EWEN, start when CS drops, and keep the
+ * chip busy (DO low) for tWC. The SPI clock and transfer delays are accounted
+ * for on a virtual clock, rather than slept through.
+ */
+/* Like real parts, the model stops returning valid data above this clock. */
+#define SIM_MAX_SPEED_HZ	2000000
+
+enum sim_state {
+	SIM_IDLE,
+	SIM_HEADER,
+	SIM_DATA_IN,
+	SIM_DATA_OUT,
+	SIM_DONE,
+};
+
+struct sim_chip {
+	uint8_t *mem;
+	const char *backing;
+	bool ewen;
+	bool selected;
+	uint64_t busy_until_us;
+	uint64_t skew_ns;
+	enum sim_state state;
+	unsigned int nr_bits;
+	uint32_t shift;
+	uint8_t opcode;
+	uint16_t addr;
+	int out_bit;
+	/* Operation to start when CS drops. */
+	void (*pending)(const struct eeprom *eeprom, struct sim_chip *chip);
+};
+
+static uint64_t sim_now_us(const struct sim_chip *chip)
+{
+	return now_us() + chip->skew_ns / 1000;
+}
+
+static unsigned int sim_word_bits(const struct eeprom *eeprom)
+{
+	return eeprom->is_x16 ? 16 : 8;
+}
+
+static uint16_t sim_word(const struct eeprom *eeprom,
+			 const struct sim_chip *chip, uint16_t addr)
+{
+	if (eeprom->is_x16)
+		return chip->mem[2 * addr] << 8 | chip->mem[2 * addr + 1];
+
+	return chip->mem[addr];
+}
+
+static void sim_set_word(const struct eeprom *eeprom, struct sim_chip *chip,
+			 uint16_t addr, uint16_t value)
+{
+	if (eeprom->is_x16) {
+		chip->mem[2 * addr] = value >> 8;
+		chip->mem[2 * addr + 1] = value;
+	} else {
+		chip->mem[addr] = value;
+	}
+}
+
+static void sim_do_write(const struct eeprom *eeprom, struct sim_chip *chip)
+{
+	sim_set_word(eeprom, chip, chip->addr, chip->shift);
+	chip->busy_until_us = sim_now_us(chip) + eeprom->twc_typ_us;
+}
+
+static void sim_do_erase(const struct eeprom *eeprom, struct sim_chip *chip)
+{
+	sim_set_word(eeprom, chip, chip->addr, 0xffff);
+	chip->busy_until_us = sim_now_us(chip) + eeprom->twc_typ_us;
+}
+
+static void sim_do_write_all(const struct eeprom *eeprom, struct sim_chip *chip)
+{
+	uint16_t addr;
+
+	for (addr = 0; addr < eeprom->size / (sim_word_bits(eeprom) / 8); addr++)
+		sim_set_word(eeprom, chip, addr, chip->shift);
+	chip->busy_until_us = sim_now_us(chip) + 2 * eeprom->twc_typ_us;
+}
+
+static void sim_do_erase_all(const struct eeprom *eeprom, struct sim_chip *chip)
+{
+	memset(chip->mem, 0xff, eeprom->size);
+	chip->busy_until_us = sim_now_us(chip) + 2 * eeprom->twc_typ_us;
+}
+
+/* Act on a complete command header. */
+static void sim_decode(const struct eeprom *eeprom, struct sim_chip *chip)
+{
+	const uint16_t nr_words = eeprom->size / (sim_word_bits(eeprom) / 8);
+	uint8_t subop;
+
+	chip->opcode = (chip->shift >> eeprom->addr_bits) & 0x3;
+	chip->addr = chip->shift & ((1 << eeprom->addr_bits) - 1);
+	chip->shift = 0;
+	chip->nr_bits = 0;
+	chip->state = SIM_DONE;
+
+	if (chip->addr >= nr_words && chip->opcode != OPCODE_EWEN)
+		chip->addr %= nr_words;
+
+	switch (chip->opcode) {
+	case OPCODE_READ:
+		chip->out_bit = -1;
+		chip->state = SIM_DATA_OUT;
+		break;
+	case OPCODE_WRITE:
+		chip->state = SIM_DATA_IN;
+		break;
+	case OPCODE_ERASE:
+		if (chip->ewen)
+			chip->pending = sim_do_erase;
+		break;
+	case OPCODE_EWEN:
+		subop = chip->addr >> (eeprom->addr_bits - 2);
+		if (subop == SUBCODE_EWEN)
+			chip->ewen = true;
+		else if (subop == SUBCODE_EWDS)
+			chip->ewen = false;
+		else if (subop == SUBCODE_ERAL && chip->ewen)
+			chip->pending = sim_do_erase_all;
+		else if (subop == SUBCODE_WRAL)
+			chip->state = SIM_DATA_IN;
+		break;
+	}
+}
+
+/* Clock one bit in on DI, and return the level of DO. */
+static int sim_clock(const struct eeprom *eeprom, struct sim_chip *chip, int di)
+{
+	const unsigned int word_bits = sim_word_bits(eeprom);
+	int dout = 1;
+
+	switch (chip->state) {
+	case SIM_IDLE:
+		/* Ready/busy status is shown on DO until a start bit. */
+		dout = sim_now_us(chip) >= chip->busy_until_us;
+		/* Instructions are ignored during a write cycle. */
+		if (di && dout) {
+			chip->state = SIM_HEADER;
+			chip->shift = 0;
+			chip->nr_bits = 0;
+		}
+		break;
+	case SIM_HEADER:
+		chip->shift = chip->shift << 1 | di;
+		if (++chip->nr_bits == 2u + eeprom->addr_bits)
+			sim_decode(eeprom, chip);
+		break;
+	case SIM_DATA_IN:
+		chip->shift = chip->shift << 1 | di;
+		if (++chip->nr_bits == word_bits) {
+			chip->state = SIM_DONE;
+			if (chip->ewen)
+				chip->pending = (chip->opcode == OPCODE_WRITE) ?
+						sim_do_write : sim_do_write_all;
+		}
+		break;
+	case SIM_DATA_OUT:
+		if (chip->out_bit < 0) {
+			dout = 0;	/* Dummy bit */
+			chip->out_bit = word_bits - 1;
+			break;
+		}
+
+		dout = (sim_word(eeprom, chip, chip->addr) >> chip->out_bit) & 1;
+		if (chip->out_bit-- == 0) {
+			chip->out_bit = word_bits - 1;
+			chip->addr++;
+			chip->addr %= eeprom->size / (word_bits / 8);
+		}
+		break;
+	case SIM_DONE:
+		break;
+	}
+
+	return dout;
+}
+
+static void sim_select(const struct eeprom *eeprom, struct sim_chip *chip,
+		       bool select)
+{
+	if (chip->selected == select)
+		return;
+
+	chip->selected = select;
+	if (!select && chip->pending)
+		chip->pending(eeprom, chip);
+
+	chip->pending = NULL;
+	chip->state = SIM_IDLE;
+}
+
+/* Words wider than a byte are kept in native byte order, as with spidev. */
+static uint32_t sim_load_word(const uint8_t *buf, unsigned int word_len)
+{
+	uint16_t w16;
+	uint32_t w32;
+
+	switch (word_len) {
+	case 1:
+		return buf[0];
+	case 2:
+		memcpy(&w16, buf, sizeof(w16));
+		return w16;
+	default:
+		memcpy(&w32, buf, sizeof(w32));
+		return w32;
+	}
+}
+
+static void sim_store_word(uint8_t *buf, unsigned int word_len, uint32_t value)
+{
+	uint16_t w16 = value;
+
+	switch (word_len) {
+	case 1:
+		buf[0] = value;
+		break;
+	case 2:
+		memcpy(buf, &w16, sizeof(w16));
+		break;
+	default:
+		memcpy(buf, &value, sizeof(value));
+		break;
+	}
+}
+
+static int sim_transfer(const struct eeprom *eeprom,
+			struct spi_ioc_transfer *xfer, unsigned int nr_xfers)
+{
+	struct sim_chip *chip = eeprom->priv;
+	unsigned int i, bits_per_word, word_len, bit;
+	size_t total = 0, w;
+	uint32_t tx, rx;
+	uint8_t *rx_buf;
+	const uint8_t *tx_buf;
+
+	/* Enforce the same limits as spidev. */
+	for (i = 0; i < nr_xfers; i++)
+		total += xfer[i].len;
+	if (total > eeprom->bufsiz || nr_xfers > SPI_MAX_XFERS) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	for (i = 0; i < nr_xfers; i++) {
+		sim_select(eeprom, chip, true);
+
+		bits_per_word = xfer[i].bits_per_word ? : 8;
+		word_len = (bits_per_word + 7) / 8;
+		if (word_len == 3)
+			word_len = 4;
+
+		tx_buf = (const uint8_t *)(uintptr_t)xfer[i].tx_buf;
+		rx_buf = (uint8_t *)(uintptr_t)xfer[i].rx_buf;
+
+		for (w = 0; w + word_len <= xfer[i].len; w += word_len) {
+			tx = tx_buf ? sim_load_word(tx_buf + w, word_len) : 0;
+			rx = 0;
+
+			for (bit = bits_per_word; bit--; )
+				rx = rx << 1 | sim_clock(eeprom, chip,
+							 (tx >> bit) & 1);
+
+			if (xfer[i].speed_hz > SIM_MAX_SPEED_HZ)
+				rx = ~rx;
+
+			if (rx_buf)
+				sim_store_word(rx_buf + w, word_len, rx);
+		}
+
+		chip->skew_ns += (xfer[i].len / word_len) * bits_per_word *
+				 1000000000ull /
+				 (xfer[i].speed_hz ? : SPI_SAFE_SPEED_HZ);
+		chip->skew_ns += xfer[i].delay_usecs * 1000ull;
+
+		/* cs_change on the last transfer leaves the chip selected. */
+		if (xfer[i].cs_change == (i + 1 == nr_xfers))
+			continue;
+
+		sim_select(eeprom, chip, false);
+	}
+
+	return total;
+}
+
+/* The model shifts words of any width, like most SPI controllers. */
+static bool sim_supports_bits(const struct eeprom *eeprom, uint8_t bits)
+{
+	(void)eeprom;
+	return bits >= 1 && bits <= 32;
+}
+
+static int sim_open(struct eeprom *eeprom, const char *path)
+{
+	struct sim_chip *chip;
+	FILE *f;
+
+	chip = calloc(1, sizeof(*chip));
+	if (!chip || !(chip->mem = malloc(eeprom->size))) {
+		free(chip);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* Parts ship erased. */
+	memset(chip->mem, 0xff, eeprom->size);
+
+	/* "sim:<file>" keeps the contents in 'file' across runs. */
+	if (path[3] == ':' && path[4]) {
+		chip->backing = path + 4;
+		f = fopen(chip->backing, "r");
+		if (f) {
+			if (fread(chip->mem, 1, eeprom->size, f) != eeprom->size)
+				memset(chip->mem, 0xff, eeprom->size);
+			fclose(f);
+		}
+	}
+
+	eeprom->priv = chip;
+	eeprom->spi_fd = -1;
+	eeprom->bufsiz = SPIDEV_DEFAULT_BUFSIZ;
+	return 0;
+}
+
+/* Save the contents to the backing file, if any. Failures are left in errno. */
+static int sim_close(struct eeprom *eeprom)
+{
+	struct sim_chip *chip = eeprom->priv;
+	int ret = 0, err = 0;
+	FILE *f;
+
+	if (chip->backing) {
+		errno = 0;
+		f = fopen(chip->backing, "w");
+		if (!f || fwrite(chip->mem, 1, eeprom->size, f) != eeprom->size)
+			err = errno ? : EIO;
+		if (f && fclose(f) && !err)
+			err = errno;
+		if (err) {
+			errno = err;
+			ret = -1;
+		}
+	}
+
+	free(chip->mem);
+	free(chip);
+	eeprom->priv = NULL;
+	return ret;
+}
+
+static const struct spi_transport sim_transport = {
+	.name = "sim",
+	.open = sim_open,
+	.close = sim_close,
+	.transfer = sim_transfer,
+	.supports_bits = sim_supports_bits,
+};
+
+/*
+ * Commands are padded to 16 bits with leading zeroes, as some controllers
+ * only shift whole bytes. When the controller can shift words of the exact
+ * width, 4 + addr_bits, use that instead: a READ header then ends with its
+ * dummy bit, and other commands take a single leading zero. The headers are
+ * the same values, but in CPU byte order, as spidev expects wider words.
+ */
+static void cmd_tables_exact(struct eeprom *eeprom)
+{
+	const uint8_t bits = 4 + eeprom->addr_bits;
+	const size_t n = (size_t)1 << eeprom->addr_bits;
+	const struct cmd_table *padded = &cmd_tables[eeprom->addr_bits];
+	const uint8_t *src;
+	struct cmd_table *exact;
+	uint8_t (*hdrs)[2];
+	uint16_t word;
+	size_t i;
+
+	if (eeprom->pad_cmds || !eeprom->transport->supports_bits ||
+	    !eeprom->transport->supports_bits(eeprom, bits))
+		return;
+
+	/* Padded headers work everywhere, so don't fail over this. */
+	exact = malloc(sizeof(*exact) + 3 * n * sizeof(*hdrs));
+	if (!exact)
+		return;
+
+	hdrs = (uint8_t (*)[2])(exact + 1);
+	for (i = 0; i < 3 * n; i++) {
+		src = i < n ? padded->read[i] :
+		      i < 2 * n ? padded->write[i - n] : padded->erase[i - 2 * n];
+		word = src[0] << 8 | src[1];
+		memcpy(hdrs[i], &word, sizeof(word));
+	}
+
+	exact->read = hdrs;
+	exact->write = hdrs + n;
+	exact->erase = hdrs + 2 * n;
+	eeprom->exact = exact;
+	eeprom->hdr_bits = bits;
+}
+
+/* Attach 'eeprom' to the device at 'path': "sim[:<file>]", or a spidev. */
+static int eeprom_open(struct eeprom *eeprom, const char *path)
+{
+	if (!strncmp(path, "sim", 3) && (path[3] == '\0' || path[3] == ':'))
+		eeprom->transport = &sim_transport;
+	else
+		eeprom->transport = &spidev_transport;
+
+	if (eeprom->transport->open(eeprom, path) < 0)
+		return -1;
+
+	cmd_tables_exact(eeprom);
+	return 0;
+}
+
+/* Detach 'eeprom' from its device. Failures are left in errno. */
+static int eeprom_close(struct eeprom *eeprom)
+{
+	int ret;
+
+	ret = eeprom->transport->close(eeprom);
+	if (eeprom->read_plan) {
+		plan_free(eeprom->read_plan);
+		free(eeprom->read_plan);
+		eeprom->read_plan = NULL;
+	}
+	free(eeprom->exact);
+	eeprom->exact = NULL;
+	eeprom->hdr_bits = 0;
+	return ret;
+}
+
+/* Open the device of 'config', and settle on its SPI clock. */
+static int eeprom_attach(const struct eeprom_cfg *config)
+{
+	int num_words;
 
 	num_words = config->eeprom->size;
 	if (config->eeprom->is_x16)
 		num_words /= 2;
 
-	printf("EEPROM config: %s, %u%s, %u command address bits\n",
-	       config->eeprom->name, num_words,
-	(config->eeprom->is_x16) ? "x16" : "x8",
-	       config->eeprom->addr_bits);
+	printf("EEPROM config: %s, %u%s, %u command address bits\n",
+	       config->eeprom->name, num_words,
+	(config->eeprom->is_x16) ? "x16" : "x8",
+	       config->eeprom->addr_bits);
+
+	if (eeprom_open(config->eeprom, config->spidev) < 0) {
+		fprintf(stderr, "Could not open SPI device %s: %s\n",
+			config->spidev, strerror(errno));
+		return -1;
+	}
+
+	if (config->speed_auto && !config->speed_retune)
+		config->eeprom->speed_hz = speed_cache_load(config->spidev);
+
+	if (config->speed_auto &&
+	    (config->speed_retune || !config->eeprom->speed_hz)) {
+		if (eeprom_tune_speed(config->eeprom) < 0) {
+			eeprom_close(config->eeprom);
+			return -1;
+		}
+
+		if (speed_cache_store(config->spidev,
+				      config->eeprom->speed_hz) < 0)
+			fprintf(stderr, "Could not save tuned SPI speed\n");
+	}
+
+	printf("SPI clock: %u Hz, %u bit commands%s\n",
+	       config->eeprom->speed_hz,
+	       config->eeprom->hdr_bits ? : 16,
+	       config->eeprom->hdr_bits ? "" : " (padded)");
+	return 0;
+}
+
+/* Close the device of 'config'. Simulated devices save their contents here. */
+static int eeprom_detach(const struct eeprom_cfg *config)
+{
+	if (eeprom_close(config->eeprom) < 0) {
+		fprintf(stderr, "Could not close SPI device %s: %s\n",
+			config->spidev, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Run the action of 'config' on its device, which is already attached. */
+static int eeprom_execute(const struct eeprom_cfg *config)
+{
+	if (config->action == EEPROM_READ)
+		return eeprom_read(config);
+	else if (config->action == EEPROM_WRITE)
+		return eeprom_write(config);
+	else if (config->action == EEPROM_ERASE)
+		return eeprom_erase(config);
+	else if (config->action == EEPROM_VERIFY)
+		return eeprom_check(config);
+
+	perror("Not implemented");
+	return EXIT_SUCCESS;
+}
+
+static int eeprom_run(const struct eeprom_cfg *config)
+{
+	int ret;
+
+	if (eeprom_attach(config) < 0)
+		return EXIT_FAILURE;
+
+	ret = eeprom_execute(config);
+
+	if (eeprom_detach(config) < 0)
+		ret = EXIT_FAILURE;
+	return ret;
+}
+
+static void stats_merge(struct eeprom_stats *dst,
+			const struct eeprom_stats *src)
+{
+	unsigned int op;
+
+	for (op = 0; op < STATS_NR_OPS; op++) {
+		hist_merge(&dst->ioctl_us[op], &src->ioctl_us[op]);
+		dst->xfers[op] += src->xfers[op];
+		dst->bytes[op] += src->bytes[op];
+	}
+
+	hist_merge(&dst->wait_us, &src->wait_us);
+	hist_merge(&dst->polls, &src->polls);
+}
+
+static void print_hist_row(const char *name, const struct stats_hist *hist,
+			   uint64_t xfers, uint64_t bytes)
+{
+	printf("%-10s %8llu %8llu %10llu %10llu %8llu %8llu %8llu %8llu\n",
+	       name, (unsigned long long)hist->count,
+	       (unsigned long long)xfers, (unsigned long long)bytes,
+	       (unsigned long long)hist->total,
+	       (unsigned long long)hist->min,
+	       (unsigned long long)hist_percentile(hist, 50),
+	       (unsigned long long)hist_percentile(hist, 99),
+	       (unsigned long long)hist->max);
+}
+
+static void print_wait_row(const char *name, const struct stats_hist *hist)
+{
+	printf("%-10s %8llu %10llu %8llu %8llu %8llu %8llu\n",
+	       name, (unsigned long long)hist->count,
+	       (unsigned long long)hist->total,
+	       (unsigned long long)hist->min,
+	       (unsigned long long)hist_percentile(hist, 50),
+	       (unsigned long long)hist_percentile(hist, 99),
+	       (unsigned long long)hist->max);
+}
+
+static void print_hist_json(const struct stats_hist *hist)
+{
+	unsigned int i;
+
+	printf("{ \"count\": %llu, \"total\": %llu, \"min\": %llu, "
+	       "\"p50\": %llu, \"p99\": %llu, \"max\": %llu, "
+	       "\"log2_histogram\": [",
+	       (unsigned long long)hist->count,
+	       (unsigned long long)hist->total,
+	       (unsigned long long)hist->min,
+	       (unsigned long long)hist_percentile(hist, 50),
+	       (unsigned long long)hist_percentile(hist, 99),
+	       (unsigned long long)hist->max);
+
+	for (i = 0; i < STATS_BUCKETS; i++)
+		printf("%s%llu", i ? ", " : "",
+		       (unsigned long long)hist->buckets[i]);
+
+	printf("] }");
+}
+
+static void print_stats(const struct eeprom_stats *stats,
+			enum stats_format format)
+{
+	unsigned int op;
+
+	if (format == STATS_TABLE) {
+		printf("\n%-10s %8s %8s %10s %10s %8s %8s %8s %8s\n", "op",
+		       "msgs", "xfers", "bytes", "total_us", "min_us",
+		       "p50_us", "p99_us", "max_us");
+		for (op = 0; op < STATS_NR_OPS; op++)
+			print_hist_row(stats_op_names[op], &stats->ioctl_us[op],
+				       stats->xfers[op], stats->bytes[op]);
+
+		printf("\n%-10s %8s %10s %8s %8s %8s %8s\n", "wait",
+		       "count", "total", "min", "p50", "p99", "max");
+		print_wait_row("busy_us", &stats->wait_us);
+		print_wait_row("polls", &stats->polls);
+	} else if (format == STATS_JSON) {
+		printf("{\n  \"ops\": {\n");
+		for (op = 0; op < STATS_NR_OPS; op++) {
+			printf("    \"%s\": { \"xfers\": %llu, \"bytes\": %llu, "
+			       "\"latency_us\": ", stats_op_names[op],
+			       (unsigned long long)stats->xfers[op],
+			       (unsigned long long)stats->bytes[op]);
+			print_hist_json(&stats->ioctl_us[op]);
+			printf(" }%s\n", op + 1 < STATS_NR_OPS ? "," : "");
+		}
+		printf("  },\n  \"busy_wait_us\": ");
+		print_hist_json(&stats->wait_us);
+		printf(",\n  \"polls_per_wait\": ");
+		print_hist_json(&stats->polls);
+		printf("\n}\n");
+	}
+}
+
+/*
+ * Gang programming: the same action is run on several devices at once. All
+ * chip selects of an SPI controller share its bus, so they are handled in
+ * turn by one worker thread, while each controller gets its own worker.
+ */
+struct gang_device {
+	struct eeprom eeprom;
+	struct eeprom_stats stats;
+	struct eeprom_cfg cfg;
+	char filename[PATH_MAX];
+	/*
+	 * Write plan, built once the device is attached. With a template, it
+	 * points into 'patched', the device's own, personalized, image.
+	 */
+	struct xfer_plan plan;
+	struct eeprom_image patched;
+	int result;
+	uint64_t elapsed_us;
+};
+
+struct gang_bus {
+	pthread_t thread;
+	char name[PATH_MAX];
+	struct gang_device *devices[GANG_MAX_DEVICES];
+	size_t nr_devices;
+	/* Whether 'thread' runs the bus, and has to be joined. */
+	bool started;
+};
+
+/*
+ * "/dev/spidevB.C" is chip select C of controller B, so it's on bus
+ * "spidevB". Devices which don't follow the pattern get a bus of their own.
+ */
+static void device_bus_name(const char *path, char *bus, size_t len)
+{
+	const char *base = strrchr(path, '/');
+	const char *dot;
+
+	base = base ? base + 1 : path;
+	dot = strrchr(base, '.');
+
+	if (!strncmp(base, "spidev", 6) && dot)
+		snprintf(bus, len, "%.*s", (int)(dot - base), base);
+	else
+		snprintf(bus, len, "%s", path);
+}
+
+/* Short name for 'path', suitable as a file name suffix. */
+static void device_label(const char *path, char *label, size_t len)
+{
+	const char *base = strrchr(path, '/');
+	char *c;
 
-	spif = init_spi_master(config->spidev);
-	if (spif < 0)
+	snprintf(label, len, "%s", base ? base + 1 : path);
+	for (c = label; *c; c++) {
+		if (*c == ':')
+			*c = '_';
+	}
+}
+
+/*
+ * Same as eeprom_write(), but up to the word writes, which are interleaved
+ * with those of the other devices on the bus. Returns the target to program,
+ * or NULL if the device is done, or failed, already.
+ */
+static struct write_target *gang_write_prepare(struct gang_device *dev,
+					       struct write_target *t,
+					       uint8_t **cur)
+{
+	const struct eeprom_cfg *cfg = &dev->cfg;
+	const struct eeprom_image *image = cfg->image;
+	struct xfer_plan *plan = &dev->plan;
+	uint8_t *readback = NULL;
+
+	/* Plans depend on what the controller, now attached, can do. */
+	if (cfg->tmpl) {
+		dev->patched.data = malloc(cfg->eeprom->size);
+		if (!dev->patched.data) {
+			perror("Could not allocate image buffer");
+			return NULL;
+		}
+		image = &dev->patched;
+	}
+
+	if (plan_write(cfg->eeprom, plan, image) < 0) {
+		perror("Could not allocate write plan");
+		return NULL;
+	}
+
+	if (cfg->tmpl && template_apply(cfg->tmpl, cfg->eeprom, plan->buf,
+					cfg->image->data, cfg->index) < 0)
+		return NULL;
+
+	if (cfg->diff_write) {
+		*cur = malloc(cfg->eeprom->size);
+		if (!*cur || read_array(cfg, *cur) < 0) {
+			perror("Could not read current EEPROM contents");
+			return NULL;
+		}
+	}
+
+	if (enable_write(cfg->eeprom) < 0) {
+		perror("Could not execute SPI transaction (enable write)");
+		return NULL;
+	}
+
+	if (eeprom_program_bulk(cfg, plan, *cur, &readback) < 0) {
+		shadow_store(cfg, NULL);
+		return NULL;
+	}
+
+	memset(t, 0, sizeof(*t));
+	t->diff = !readback;
+	if (readback) {
+		free(*cur);
+		*cur = readback;
+	}
+
+	t->eeprom = cfg->eeprom;
+	t->plan = plan;
+	t->cur = *cur;
+	t->name = cfg->spidev;
+	t->result = EXIT_SUCCESS;
+
+	return t;
+}
+
+/*
+ * Write all devices of a bus at once. Each is attached and prepared in turn,
+ * then their word writes are interleaved, and finally each is verified.
+ */
+static void gang_bus_write(struct gang_bus *bus)
+{
+	struct write_target targets[GANG_MAX_DEVICES];
+	struct gang_device *devs[GANG_MAX_DEVICES], *dev;
+	uint8_t *cur[GANG_MAX_DEVICES] = { NULL };
+	bool attached[GANG_MAX_DEVICES] = { false };
+	uint64_t start = now_us();
+	size_t i, nr_targets = 0;
+
+	for (i = 0; i < bus->nr_devices; i++) {
+		dev = bus->devices[i];
+		dev->result = EXIT_FAILURE;
+
+		attached[i] = eeprom_attach(&dev->cfg) == 0;
+		if (!attached[i])
+			continue;
+
+		if (gang_write_prepare(dev, &targets[nr_targets], &cur[i]))
+			devs[nr_targets++] = dev;
+	}
+
+	eeprom_program_interleaved(targets, nr_targets);
+
+	for (i = 0; i < nr_targets; i++) {
+		dev = devs[i];
+		dev->result = targets[i].result;
+		if (dev->result == EXIT_SUCCESS && dev->cfg.verify)
+			dev->result = eeprom_verify(&dev->cfg, &dev->plan);
+		shadow_written(&dev->cfg, &dev->plan, targets[i].cur,
+			       dev->result == EXIT_SUCCESS);
+	}
+
+	for (i = 0; i < bus->nr_devices; i++) {
+		dev = bus->devices[i];
+		dev->elapsed_us = now_us() - start;
+		if (attached[i] && eeprom_detach(&dev->cfg) < 0)
+			dev->result = EXIT_FAILURE;
+		free(cur[i]);
+	}
+}
+
+static void *gang_bus_worker(void *arg)
+{
+	struct gang_bus *bus = arg;
+	struct gang_device *dev;
+	uint64_t start;
+	size_t i;
+
+	/* Paced writes already keep the bus busy, so they run in turn. */
+	if (bus->nr_devices > 1 && bus->devices[0]->cfg.action == EEPROM_WRITE &&
+	    !bus->devices[0]->eeprom.wait->paced) {
+		gang_bus_write(bus);
+		return NULL;
+	}
+
+	for (i = 0; i < bus->nr_devices; i++) {
+		dev = bus->devices[i];
+		start = now_us();
+		dev->result = eeprom_run(&dev->cfg);
+		dev->elapsed_us = now_us() - start;
+	}
+
+	return NULL;
+}
+
+static int eeprom_run_gang(const struct eeprom_cfg *config, char **paths,
+			   size_t nr_paths)
+{
+	struct gang_device *devices, *dev;
+	struct gang_bus *buses, *bus;
+	char bus_name[PATH_MAX], label[PATH_MAX];
+	struct eeprom_image image = { 0 };
+	size_t i, j, nr_buses = 0, nr_failed = 0;
+	int ret;
+
+	devices = calloc(nr_paths, sizeof(*devices));
+	buses = calloc(nr_paths, sizeof(*buses));
+	if (!devices || !buses) {
+		perror("Could not allocate gang state");
+		free(devices);
+		free(buses);
 		return EXIT_FAILURE;
+	}
+
+	/* All devices get the same image, so only load it once. */
+	if (config->action == EEPROM_WRITE) {
+		if (load_image(config, &image) < 0) {
+			free(devices);
+			free(buses);
+			return EXIT_FAILURE;
+		}
+	}
 
-	config->eeprom->spi_fd = spif;
+	for (i = 0; i < nr_paths; i++) {
+		dev = &devices[i];
+		dev->eeprom = *config->eeprom;
+		dev->cfg = *config;
+		dev->cfg.eeprom = &dev->eeprom;
+		dev->cfg.spidev = paths[i];
+		dev->cfg.index = config->index + i;
+		if (config->action == EEPROM_WRITE)
+			dev->cfg.image = &image;
+		if (config->eeprom->stats)
+			dev->eeprom.stats = &dev->stats;
 
-	if (config->action == EEPROM_READ)
-		return eeprom_read(config);
-	else if (config->action == EEPROM_WRITE)
-		return eeprom_write(config);
-	else if (config->action == EEPROM_ERASE)
-		return eeprom_erase(config);
-	else
-		perror("Not implemented");
+		if (config->action == EEPROM_READ) {
+			device_label(paths[i], label, sizeof(label));
+			ret = snprintf(dev->filename, sizeof(dev->filename),
+				       "%s.%s", config->filename, label);
+			if (ret < 0 || (size_t)ret >= sizeof(dev->filename)) {
+				fprintf(stderr, "Output file name too long\n");
+				unload_image(config, &image);
+				free(devices);
+				free(buses);
+				return EXIT_FAILURE;
+			}
+			dev->cfg.filename = dev->filename;
+			/* The suffix hides the extension of 'filename'. */
+			dev->cfg.format = image_format_of(config);
+		}
+
+		device_bus_name(paths[i], bus_name, sizeof(bus_name));
+		for (j = 0; j < nr_buses; j++) {
+			if (!strcmp(buses[j].name, bus_name))
+				break;
+		}
+
+		bus = &buses[j];
+		if (j == nr_buses) {
+			snprintf(bus->name, sizeof(bus->name), "%s", bus_name);
+			nr_buses++;
+		}
+
+		bus->devices[bus->nr_devices++] = dev;
+	}
+
+	for (i = 0; i < nr_buses; i++) {
+		ret = pthread_create(&buses[i].thread, NULL, gang_bus_worker,
+				     &buses[i]);
+		if (ret) {
+			errno = ret;
+			perror("Could not start bus worker");
+			/* Run it here instead, so no device is left out. */
+			gang_bus_worker(&buses[i]);
+		} else {
+			buses[i].started = true;
+		}
+	}
+
+	for (i = 0; i < nr_buses; i++) {
+		if (buses[i].started)
+			pthread_join(buses[i].thread, NULL);
+	}
+
+	printf("\n%-24s %-16s %-8s %s\n", "Device", "Bus", "Result", "Time");
+	for (i = 0; i < nr_buses; i++) {
+		bus = &buses[i];
+		for (j = 0; j < bus->nr_devices; j++) {
+			dev = bus->devices[j];
+			printf("%-24s %-16s %-8s %llu ms\n", dev->cfg.spidev,
+			       bus->name,
+			       dev->result == EXIT_SUCCESS ? "ok" : "FAILED",
+			       (unsigned long long)dev->elapsed_us / 1000);
+			nr_failed += (dev->result != EXIT_SUCCESS);
+			if (config->eeprom->stats)
+				stats_merge(config->eeprom->stats, &dev->stats);
+		}
+	}
+
+	printf("%zu of %zu devices succeeded\n", nr_paths - nr_failed,
+	       nr_paths);
+
+	for (i = 0; i < nr_paths; i++) {
+		plan_free(&devices[i].plan);
+		free(devices[i].patched.data);
+	}
+	unload_image(config, &image);
+	free(devices);
+	free(buses);
+
+	return nr_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Jobs for the devices of one SPI controller, which its worker thread runs in
+ * turn. A job is any struct with a 'void *' link to the next one, 'link'
+ * bytes into it, so queueing doesn't allocate. Daemon jobs and library jobs
+ * both go through here.
+ */
+struct bus_queue {
+	pthread_t thread;
+	char name[PATH_MAX];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	void *head, *tail;
+	size_t link;
+	/* Called by the worker, without the lock held, for each job. */
+	void (*run)(struct bus_queue *bus, void *job);
+	bool stop;
+};
+
+static void **bus_job_link(const struct bus_queue *bus, void *job)
+{
+	return (void **)((char *)job + bus->link);
+}
+
+static void *bus_queue_worker(void *arg)
+{
+	struct bus_queue *bus = arg;
+	void *job;
+
+	pthread_mutex_lock(&bus->lock);
+	for (;;) {
+		while (!bus->head && !bus->stop)
+			pthread_cond_wait(&bus->cond, &bus->lock);
+
+		/* Finish the queue before stopping. */
+		job = bus->head;
+		if (!job)
+			break;
+
+		bus->head = *bus_job_link(bus, job);
+		if (!bus->head)
+			bus->tail = NULL;
+		pthread_mutex_unlock(&bus->lock);
+
+		bus->run(bus, job);
+
+		pthread_mutex_lock(&bus->lock);
+	}
+	pthread_mutex_unlock(&bus->lock);
+
+	return NULL;
+}
+
+/*
+ * Set up 'bus' for the controller of 'path', and start its worker. Returns
+ * -1, with errno set, if the thread can't be started.
+ */
+static int bus_queue_start(struct bus_queue *bus, const char *path,
+			   size_t link,
+			   void (*run)(struct bus_queue *bus, void *job))
+{
+	int ret;
+
+	device_bus_name(path, bus->name, sizeof(bus->name));
+	bus->link = link;
+	bus->run = run;
+	bus->head = bus->tail = NULL;
+	bus->stop = false;
+	pthread_mutex_init(&bus->lock, NULL);
+	pthread_cond_init(&bus->cond, NULL);
+
+	ret = pthread_create(&bus->thread, NULL, bus_queue_worker, bus);
+	if (ret) {
+		pthread_cond_destroy(&bus->cond);
+		pthread_mutex_destroy(&bus->lock);
+		errno = ret;
+		return -1;
+	}
 
 	return 0;
 }
+
+/* Whether 'path' is a device on the controller of 'bus'. */
+static bool bus_queue_has(const struct bus_queue *bus, const char *path)
+{
+	char name[PATH_MAX];
+
+	device_bus_name(path, name, sizeof(name));
+	return !strcmp(bus->name, name);
+}
+
+static void bus_queue_submit(struct bus_queue *bus, void *job)
+{
+	pthread_mutex_lock(&bus->lock);
+	*bus_job_link(bus, job) = NULL;
+	if (bus->tail)
+		*bus_job_link(bus, bus->tail) = job;
+	else
+		bus->head = job;
+	bus->tail = job;
+	pthread_cond_signal(&bus->cond);
+	pthread_mutex_unlock(&bus->lock);
+}
+
+/* Run the jobs still queued, then stop the worker. */
+static void bus_queue_stop(struct bus_queue *bus)
+{
+	pthread_mutex_lock(&bus->lock);
+	bus->stop = true;
+	pthread_cond_signal(&bus->cond);
+	pthread_mutex_unlock(&bus->lock);
+
+	pthread_join(bus->thread, NULL);
+	pthread_cond_destroy(&bus->cond);
+	pthread_mutex_destroy(&bus->lock);
+}
+
+/*
+ * Daemon mode: devices are opened and configured once, and kept open, while
+ * jobs come in over a Unix socket. Each request is a line:
+ *   <read|write|verify|erase> <device> [<file>] [<option>...]
+ * with options 'offset=<n>', 'length=<n>', 'index=<n>', 'format=<fmt>',
+ * 'verify' and 'diff'. Jobs for the same SPI controller are queued and run in
+ * turn by its worker, and the reply to each line is "ok <ms>", "failed <ms>"
+ * or "error <reason>".
+ */
+struct daemon;
+
+struct daemon_device {
+	struct eeprom eeprom;
+	char path[PATH_MAX];
+	struct daemon_device *next;
+};
+
+struct daemon_job {
+	struct eeprom_cfg cfg;
+	char spidev[PATH_MAX];
+	char filename[PATH_MAX];
+	int result;
+	/* Set, and signalled, under the lock of the bus queue. */
+	bool done;
+	pthread_cond_t done_cond;
+	void *next;
+};
+
+struct daemon_bus {
+	/* First, as the worker only passes this on. */
+	struct bus_queue queue;
+	struct daemon *daemon;
+	struct daemon_device *devices;
+	struct daemon_bus *next;
+};
+
+struct daemon_client;
+
+struct daemon {
+	const struct eeprom_cfg *defaults;
+	pthread_mutex_t lock;
+	struct daemon_bus *buses;
+	/* Connections being served, and a signal for when one is done. */
+	struct daemon_client *clients;
+	pthread_cond_t client_done;
+};
+
+struct daemon_client {
+	struct daemon *daemon;
+	int fd;
+	struct daemon_client *next;
+};
+
+static volatile sig_atomic_t daemon_stop;
+
+static void daemon_signal(int sig)
+{
+	(void)sig;
+	daemon_stop = 1;
+}
+
+/* Find the open device at 'path', or open it. Called by the bus worker. */
+static struct daemon_device *daemon_device_get(struct daemon *daemon,
+					       struct daemon_bus *bus,
+					       const char *path)
+{
+	struct daemon_device *dev;
+	struct eeprom_cfg cfg = *daemon->defaults;
+
+	for (dev = bus->devices; dev; dev = dev->next) {
+		if (!strcmp(dev->path, path))
+			return dev;
+	}
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return NULL;
+
+	snprintf(dev->path, sizeof(dev->path), "%s", path);
+	dev->eeprom = *daemon->defaults->eeprom;
+	dev->eeprom.stats = NULL;
+	cfg.eeprom = &dev->eeprom;
+	cfg.spidev = dev->path;
+
+	/* A device which fails to open is retried by the next job. */
+	if (eeprom_attach(&cfg) < 0) {
+		free(dev);
+		return NULL;
+	}
+
+	dev->next = bus->devices;
+	bus->devices = dev;
+	return dev;
+}
+
+/* Run 'job' on its device, opening it first if needed. */
+static void daemon_bus_run(struct bus_queue *queue, void *arg)
+{
+	struct daemon_bus *bus = (struct daemon_bus *)queue;
+	struct daemon_job *job = arg;
+	struct daemon_device *dev;
+
+	dev = daemon_device_get(bus->daemon, bus, job->cfg.spidev);
+	if (dev) {
+		job->cfg.eeprom = &dev->eeprom;
+		job->result = eeprom_execute(&job->cfg);
+	} else {
+		job->result = EXIT_FAILURE;
+	}
+
+	pthread_mutex_lock(&queue->lock);
+	job->done = true;
+	pthread_cond_signal(&job->done_cond);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/* Finish the jobs of 'bus', then close its devices. */
+static void daemon_bus_stop(struct daemon_bus *bus)
+{
+	struct daemon_device *dev, *next;
+
+	bus_queue_stop(&bus->queue);
+
+	for (dev = bus->devices; dev; dev = next) {
+		next = dev->next;
+		if (eeprom_close(&dev->eeprom) < 0)
+			fprintf(stderr, "Could not close SPI device %s: %s\n",
+				dev->path, strerror(errno));
+		free(dev);
+	}
+}
+
+/* Find the bus of 'path', starting a worker for it if it's a new one. */
+static struct daemon_bus *daemon_bus_get(struct daemon *daemon,
+					 const char *path)
+{
+	struct daemon_bus *bus;
+
+	pthread_mutex_lock(&daemon->lock);
+	for (bus = daemon->buses; bus; bus = bus->next) {
+		if (bus_queue_has(&bus->queue, path))
+			goto out;
+	}
+
+	bus = calloc(1, sizeof(*bus));
+	if (!bus)
+		goto out;
+
+	bus->daemon = daemon;
+	if (bus_queue_start(&bus->queue, path, offsetof(struct daemon_job, next),
+			    daemon_bus_run) < 0) {
+		perror("Could not start bus worker");
+		free(bus);
+		bus = NULL;
+		goto out;
+	}
+
+	bus->next = daemon->buses;
+	daemon->buses = bus;
+out:
+	pthread_mutex_unlock(&daemon->lock);
+	return bus;
+}
+
+/* Queue 'job' on the bus of its device, and wait for it to complete. */
+static int daemon_run_job(struct daemon *daemon, struct daemon_job *job)
+{
+	struct daemon_bus *bus;
+
+	bus = daemon_bus_get(daemon, job->cfg.spidev);
+	if (!bus)
+		return EXIT_FAILURE;
+
+	pthread_cond_init(&job->done_cond, NULL);
+	bus_queue_submit(&bus->queue, job);
+
+	pthread_mutex_lock(&bus->queue.lock);
+	while (!job->done)
+		pthread_cond_wait(&job->done_cond, &bus->queue.lock);
+	pthread_mutex_unlock(&bus->queue.lock);
+
+	pthread_cond_destroy(&job->done_cond);
+	return job->result;
+}
+
+/* Parse a request line into 'job'. Returns an error message, or NULL. */
+static const char *daemon_parse_job(struct daemon *daemon, char *line,
+				    struct daemon_job *job)
+{
+	char *save, *verb, *word, *value;
+
+	memset(job, 0, sizeof(*job));
+	job->cfg = *daemon->defaults;
+	job->cfg.spidev = job->spidev;
+	job->cfg.filename = job->filename;
+
+	verb = strtok_r(line, " \t", &save);
+	if (!verb)
+		return "empty request";
+
+	if (!strcmp(verb, "read"))
+		job->cfg.action = EEPROM_READ;
+	else if (!strcmp(verb, "write"))
+		job->cfg.action = EEPROM_WRITE;
+	else if (!strcmp(verb, "verify"))
+		job->cfg.action = EEPROM_VERIFY;
+	else if (!strcmp(verb, "erase"))
+		job->cfg.action = EEPROM_ERASE;
+	else
+		return "unknown action";
+
+	word = strtok_r(NULL, " \t", &save);
+	if (!word)
+		return "no device";
+	snprintf(job->spidev, sizeof(job->spidev), "%s", word);
+
+	if (job->cfg.action != EEPROM_ERASE) {
+		word = strtok_r(NULL, " \t", &save);
+		if (!word)
+			return "no file";
+		snprintf(job->filename, sizeof(job->filename), "%s", word);
+	}
+
+	while ((word = strtok_r(NULL, " \t", &save))) {
+		value = strchr(word, '=');
+		if (value)
+			*value++ = '\0';
+
+		if (!strcmp(word, "verify") && !value)
+			job->cfg.verify = true;
+		else if (!strcmp(word, "diff") && !value)
+			job->cfg.diff_write = true;
+		else if (!strcmp(word, "offset") && value)
+			job->cfg.offset = strtoul(value, NULL, 0);
+		else if (!strcmp(word, "length") && value)
+			job->cfg.length = strtoul(value, NULL, 0);
+		else if (!strcmp(word, "index") && value)
+			job->cfg.index = strtoul(value, NULL, 0);
+		else if (!strcmp(word, "format") && value &&
+			 image_format_find(value))
+			job->cfg.format = image_format_find(value);
+		else
+			return "bad option";
+	}
+
+	/* Geometry comes from the defaults, so only the range is checked. */
+	if (job->cfg.offset >= job->cfg.eeprom->size ||
+	    job->cfg.length > job->cfg.eeprom->size - job->cfg.offset ||
+	    (job->cfg.eeprom->is_x16 &&
+	     ((job->cfg.offset | job->cfg.length) & 1)))
+		return "bad range";
+
+	return NULL;
+}
+
+/*
+ * Close the connection of 'client', and let the daemon know it's done. The
+ * fd is closed under the lock, so the daemon doesn't shut down a reused one.
+ */
+static void daemon_client_done(struct daemon_client *client, FILE *conn)
+{
+	struct daemon *daemon = client->daemon;
+	struct daemon_client **p;
+
+	pthread_mutex_lock(&daemon->lock);
+	for (p = &daemon->clients; *p != client; p = &(*p)->next)
+		;
+	*p = client->next;
+
+	if (conn)
+		fclose(conn);
+	else
+		close(client->fd);
+
+	pthread_cond_signal(&daemon->client_done);
+	pthread_mutex_unlock(&daemon->lock);
+	free(client);
+}
+
+/* Serve the requests of one connection, one line at a time. */
+static void *daemon_client(void *arg)
+{
+	struct daemon_client *client = arg;
+	struct daemon_job job;
+	char line[DAEMON_LINE_MAX];
+	const char *error;
+	uint64_t start;
+	FILE *conn;
+	int ret;
+
+	conn = fdopen(client->fd, "r+");
+	if (!conn) {
+		daemon_client_done(client, NULL);
+		return NULL;
+	}
+
+	while (fgets(line, sizeof(line), conn)) {
+		line[strcspn(line, "\r\n")] = '\0';
+
+		error = daemon_parse_job(client->daemon, line, &job);
+		if (error) {
+			fprintf(conn, "error %s\n", error);
+			fflush(conn);
+			continue;
+		}
+
+		start = now_us();
+		ret = daemon_run_job(client->daemon, &job);
+		fprintf(conn, "%s %llu ms\n",
+			ret == EXIT_SUCCESS ? "ok" : "failed",
+			(unsigned long long)(now_us() - start) / 1000);
+		fflush(conn);
+	}
+
+	daemon_client_done(client, conn);
+	return NULL;
+}
+
+static int eeprom_daemon(const struct eeprom_cfg *config, const char *path)
+{
+	struct daemon daemon = { .defaults = config };
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct daemon_client *client;
+	struct daemon_bus *bus, *next;
+	struct sigaction sa = { .sa_handler = daemon_signal };
+	pthread_t thread;
+	int sock, fd, ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return EXIT_FAILURE;
+	}
+	strcpy(addr.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("Could not create socket");
+		return EXIT_FAILURE;
+	}
+
+	/* A socket left behind by a previous instance is in the way. */
+	unlink(path);
+	/*
+	 * Clients can program any device, and read or write any file, as the
+	 * daemon's user, so only that user may connect. Nobody can, before
+	 * listen(), so the mode is set in time.
+	 */
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    chmod(path, 0600) < 0 || listen(sock, 16) < 0) {
+		perror("Could not listen on socket");
+		close(sock);
+		return EXIT_FAILURE;
+	}
+
+	/* No SA_RESTART, so that accept() returns when asked to stop. */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	pthread_mutex_init(&daemon.lock, NULL);
+	pthread_cond_init(&daemon.client_done, NULL);
+
+	printf("Waiting for jobs on %s\n", path);
+	fflush(stdout);
+
+	while (!daemon_stop) {
+		fd = accept(sock, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("Could not accept connection");
+			break;
+		}
+
+		client = malloc(sizeof(*client));
+		if (!client) {
+			close(fd);
+			continue;
+		}
+
+		client->daemon = &daemon;
+		client->fd = fd;
+
+		pthread_mutex_lock(&daemon.lock);
+		client->next = daemon.clients;
+		daemon.clients = client;
+		ret = pthread_create(&thread, NULL, daemon_client, client);
+		if (ret) {
+			daemon.clients = client->next;
+			pthread_mutex_unlock(&daemon.lock);
+			errno = ret;
+			perror("Could not start client thread");
+			close(fd);
+			free(client);
+			continue;
+		}
+		pthread_detach(thread);
+		pthread_mutex_unlock(&daemon.lock);
+	}
+
+	close(sock);
+	unlink(path);
+
+	/*
+	 * Stop reading requests, and wait for the clients to finish the jobs
+	 * they already queued, as they still use the buses.
+	 */
+	pthread_mutex_lock(&daemon.lock);
+	for (client = daemon.clients; client; client = client->next)
+		shutdown(client->fd, SHUT_RD);
+	while (daemon.clients)
+		pthread_cond_wait(&daemon.client_done, &daemon.lock);
+	pthread_mutex_unlock(&daemon.lock);
+
+	/* Let queued jobs finish, then close the devices. */
+	pthread_mutex_lock(&daemon.lock);
+	for (bus = daemon.buses; bus; bus = next) {
+		next = bus->next;
+		daemon_bus_stop(bus);
+		free(bus);
+	}
+	daemon.buses = NULL;
+	pthread_mutex_unlock(&daemon.lock);
+
+	return EXIT_SUCCESS;
+}
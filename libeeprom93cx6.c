@@ -0,0 +1,492 @@
+/*
+ * libeeprom93cx6 - 93Cxx serial EEPROM access over spidev, as a library
+ *
+ * Copyright (C) 2016 Alexandru Gagniuc <mr.nuke.me@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * The library is built from the same source as the programmer, so both use
+ * the same command encoding, transports and wait strategies. Only the entry
+ * points below are exported.
+ */
+#define EEPROM_93CXX_NO_MAIN
+#include "eeprom-93cxx.c"
+
+#include <sys/eventfd.h>
+
+#include "libeeprom93cx6.h"
+
+struct eeprom93 {
+	struct eeprom eeprom;
+	/* The simulator keeps a pointer to the path of its backing file. */
+	char path[PATH_MAX];
+};
+
+/* Turn a -1 return with errno set into a negative errno value. */
+static int lib_error(void)
+{
+	return errno ? -errno : -EIO;
+}
+
+static int lib_check_geometry(const struct eeprom *eeprom)
+{
+	const size_t step = eeprom->is_x16 ? 2 : 1;
+
+	if (!eeprom->size || (eeprom->size & (eeprom->size - 1)))
+		return -EINVAL;
+	if (eeprom->addr_bits < 5 || eeprom->addr_bits > 9)
+		return -EINVAL;
+	if (!(eeprom->flags & (eeprom->is_x16 ? EEPROM_X16 : EEPROM_X8)))
+		return -EINVAL;
+	if (eeprom->size / step > (1u << eeprom->addr_bits))
+		return -EINVAL;
+
+	return 0;
+}
+
+static int lib_check_range(const struct eeprom93 *handle, size_t offset,
+			   size_t len)
+{
+	const size_t step = eeprom93_word_size(handle);
+
+	if (offset > handle->eeprom.size || len > handle->eeprom.size - offset)
+		return -EINVAL;
+	if ((offset | len) & (step - 1))
+		return -EINVAL;
+
+	return 0;
+}
+
+static int lib_open(struct eeprom93 **handle, const char *device,
+		    const struct eeprom *geometry)
+{
+	struct eeprom93 *h;
+	int ret;
+
+	ret = lib_check_geometry(geometry);
+	if (ret < 0)
+		return ret;
+
+	if (strlen(device) >= sizeof(h->path))
+		return -EINVAL;
+
+	h = calloc(1, sizeof(*h));
+	if (!h)
+		return -ENOMEM;
+
+	h->eeprom = *geometry;
+	h->eeprom.speed_hz = SPI_SAFE_SPEED_HZ;
+	h->eeprom.wait = wait_strategy_find("backoff");
+	strcpy(h->path, device);
+
+	errno = 0;
+	if (eeprom_open(&h->eeprom, h->path) < 0) {
+		ret = lib_error();
+		free(h);
+		return ret;
+	}
+
+	*handle = h;
+	return 0;
+}
+
+int eeprom93_open(struct eeprom93 **handle, const char *device,
+		  const char *type, int x16)
+{
+	const struct eeprom *part = eeprom_find(type);
+	struct eeprom geometry;
+
+	if (!part)
+		return -EINVAL;
+
+	geometry = *part;
+	geometry.is_x16 = x16;
+	/* x16 mode uses one less address bits than x8 */
+	if (x16)
+		geometry.addr_bits--;
+
+	return lib_open(handle, device, &geometry);
+}
+
+int eeprom93_open_geometry(struct eeprom93 **handle, const char *device,
+			   size_t size, unsigned int addr_bits, int x16)
+{
+	struct eeprom geometry = {
+		.name = "custom",
+		.size = size,
+		.addr_bits = addr_bits,
+		.flags = EEPROM_ORG,
+		.is_x16 = x16,
+		.twc_typ_us = DEFAULT_TWC_TYP_US,
+		.twc_max_us = DEFAULT_TWC_MAX_US,
+	};
+
+	if (size > UINT16_MAX || addr_bits > 9)
+		return -EINVAL;
+
+	return lib_open(handle, device, &geometry);
+}
+
+void eeprom93_close(struct eeprom93 *handle)
+{
+	if (!handle)
+		return;
+
+	eeprom_close(&handle->eeprom);
+	free(handle);
+}
+
+int eeprom93_set_speed(struct eeprom93 *handle, uint32_t speed_hz)
+{
+	if (!speed_hz)
+		return -EINVAL;
+
+	handle->eeprom.speed_hz = speed_hz;
+	return 0;
+}
+
+size_t eeprom93_size(const struct eeprom93 *handle)
+{
+	return handle->eeprom.size;
+}
+
+size_t eeprom93_word_size(const struct eeprom93 *handle)
+{
+	return handle->eeprom.is_x16 ? 2 : 1;
+}
+
+/*
+ * Same as read_range(), but quietly: sequential reads, checked, with one
+ * command per word as the fallback.
+ */
+int eeprom93_read(struct eeprom93 *handle, size_t offset, void *buf,
+		  size_t len)
+{
+	struct eeprom *eeprom = &handle->eeprom;
+	const size_t step = eeprom93_word_size(handle);
+	int ret;
+
+	ret = lib_check_range(handle, offset, len);
+	if (ret < 0 || !len)
+		return ret;
+
+	errno = 0;
+	if (!eeprom->no_seq_read) {
+		ret = read_sequential(eeprom, buf, offset / step, len / step);
+		if (ret < 0)
+			return lib_error();
+
+		if (ret == 0 &&
+		    probe_sequential(eeprom, buf, offset / step, len / step))
+			return 0;
+
+		eeprom->no_seq_read = true;
+	}
+
+	if (read_words(eeprom, buf, offset / step, len / step) < 0)
+		return lib_error();
+
+	return 0;
+}
+
+int eeprom93_write(struct eeprom93 *handle, size_t offset, const void *buf,
+		   size_t len, const void *cur)
+{
+	const struct eeprom *eeprom = &handle->eeprom;
+	const size_t step = eeprom93_word_size(handle);
+	const uint8_t *data = buf, *old = cur;
+	const uint8_t (*hdrs)[2] = cmd_table(eeprom)->write;
+	size_t i;
+	int ret;
+
+	ret = lib_check_range(handle, offset, len);
+	if (ret < 0 || !len)
+		return ret;
+
+	errno = 0;
+	if (enable_write(eeprom) < 0)
+		return lib_error();
+
+	for (i = 0; i < len; i += step) {
+		if (old && !memcmp(old + i, data + i, step))
+			continue;
+
+		if (send_data_command(eeprom,
+				      hdrs[cmd_addr(eeprom, (offset + i) / step)],
+				      data + i, step) < 0 ||
+		    wait_write_cycle(eeprom) < 0)
+			return lib_error();
+	}
+
+	return 0;
+}
+
+int eeprom93_erase(struct eeprom93 *handle, size_t offset, size_t len)
+{
+	const struct eeprom *eeprom = &handle->eeprom;
+	const size_t step = eeprom93_word_size(handle);
+	size_t i;
+	int ret;
+
+	ret = lib_check_range(handle, offset, len);
+	if (ret < 0 || !len)
+		return ret;
+
+	if (len == eeprom->size)
+		return eeprom93_erase_all(handle);
+
+	errno = 0;
+	if (enable_write(eeprom) < 0)
+		return lib_error();
+
+	for (i = offset; i < offset + len; i += step) {
+		if (erase_word(eeprom, i / step) < 0 ||
+		    wait_write_cycle(eeprom) < 0)
+			return lib_error();
+	}
+
+	return 0;
+}
+
+int eeprom93_verify(struct eeprom93 *handle, size_t offset, const void *buf,
+		    size_t len)
+{
+	const uint8_t *data = buf;
+	uint8_t chunk[256];
+	size_t done, n;
+	int ret;
+
+	ret = lib_check_range(handle, offset, len);
+	if (ret < 0)
+		return ret;
+
+	/* Compare a chunk at a time, so nothing needs to be allocated. */
+	for (done = 0; done < len; done += n) {
+		n = len - done < sizeof(chunk) ? len - done : sizeof(chunk);
+
+		ret = eeprom93_read(handle, offset + done, chunk, n);
+		if (ret < 0)
+			return ret;
+		if (memcmp(chunk, data + done, n))
+			return -EBADMSG;
+	}
+
+	return 0;
+}
+
+int eeprom93_write_all(struct eeprom93 *handle, uint16_t word)
+{
+	const struct eeprom *eeprom = &handle->eeprom;
+	uint8_t value[2] = { word >> 8, word };
+
+	if (!eeprom->is_x16 && word > 0xff)
+		return -EINVAL;
+
+	errno = 0;
+	if (enable_write(eeprom) < 0 ||
+	    write_all(eeprom, eeprom->is_x16 ? value : value + 1,
+		      eeprom93_word_size(handle)) < 0 ||
+	    wait_bulk_cycle(eeprom) < 0)
+		return lib_error();
+
+	return 0;
+}
+
+int eeprom93_erase_all(struct eeprom93 *handle)
+{
+	const struct eeprom *eeprom = &handle->eeprom;
+
+	errno = 0;
+	if (enable_write(eeprom) < 0 || erase_all(eeprom) < 0 ||
+	    wait_bulk_cycle(eeprom) < 0)
+		return lib_error();
+
+	return 0;
+}
+
+/*
+ * Jobs are queued per bus, on the same queues as daemon jobs. The scheduler
+ * lock covers its list of buses, and the queue of completed jobs. Every
+ * completion adds to the eventfd, and reaping the last job drains it, both
+ * under the lock. So it is readable whenever the completed queue isn't
+ * empty, even if the caller reads it too.
+ */
+struct lib_bus {
+	/* First, as the worker only passes this on. */
+	struct bus_queue queue;
+	struct eeprom93_sched *sched;
+	struct lib_bus *next;
+};
+
+struct eeprom93_sched {
+	pthread_mutex_t lock;
+	struct lib_bus *buses;
+	struct eeprom93_job *head, *tail;
+	int efd;
+};
+
+static int lib_run_job(struct eeprom93_job *job)
+{
+	struct eeprom93 *h = job->handle;
+
+	switch (job->op) {
+	case EEPROM93_READ:
+		return eeprom93_read(h, job->offset, job->buf, job->len);
+	case EEPROM93_WRITE:
+		return eeprom93_write(h, job->offset, job->buf, job->len,
+				      job->cur);
+	case EEPROM93_VERIFY:
+		return eeprom93_verify(h, job->offset, job->buf, job->len);
+	case EEPROM93_ERASE:
+		return eeprom93_erase(h, job->offset, job->len);
+	default:
+		return -EINVAL;
+	}
+}
+
+/* Run 'job', then either call it back, or queue it to be reaped. */
+static void lib_bus_run(struct bus_queue *queue, void *arg)
+{
+	struct eeprom93_sched *sched = ((struct lib_bus *)queue)->sched;
+	struct eeprom93_job *job = arg;
+	const uint64_t one = 1;
+	ssize_t n;
+
+	job->result = lib_run_job(job);
+	if (job->done) {
+		job->done(job);
+		return;
+	}
+
+	pthread_mutex_lock(&sched->lock);
+	job->next = NULL;
+	if (sched->tail)
+		sched->tail->next = job;
+	else
+		sched->head = job;
+	sched->tail = job;
+	/* The eventfd counter can't overflow, so this can't fail. */
+	n = write(sched->efd, &one, sizeof(one));
+	pthread_mutex_unlock(&sched->lock);
+
+	(void)n;
+}
+
+/* Find the bus of 'path', starting a worker for it if it's a new one. */
+static struct lib_bus *lib_bus_get(struct eeprom93_sched *sched,
+				   const char *path)
+{
+	struct lib_bus *bus;
+
+	for (bus = sched->buses; bus; bus = bus->next) {
+		if (bus_queue_has(&bus->queue, path))
+			return bus;
+	}
+
+	bus = calloc(1, sizeof(*bus));
+	if (!bus)
+		return NULL;
+
+	bus->sched = sched;
+	if (bus_queue_start(&bus->queue, path,
+			    offsetof(struct eeprom93_job, next),
+			    lib_bus_run) < 0) {
+		free(bus);
+		return NULL;
+	}
+
+	bus->next = sched->buses;
+	sched->buses = bus;
+	return bus;
+}
+
+int eeprom93_sched_create(struct eeprom93_sched **sched)
+{
+	struct eeprom93_sched *s;
+	int ret;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	s->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (s->efd < 0) {
+		ret = -errno;
+		free(s);
+		return ret;
+	}
+
+	pthread_mutex_init(&s->lock, NULL);
+	*sched = s;
+	return 0;
+}
+
+void eeprom93_sched_destroy(struct eeprom93_sched *sched)
+{
+	struct lib_bus *bus, *next;
+
+	if (!sched)
+		return;
+
+	/* Completions still take the lock, so it isn't held here. */
+	for (bus = sched->buses; bus; bus = next) {
+		next = bus->next;
+		bus_queue_stop(&bus->queue);
+		free(bus);
+	}
+
+	pthread_mutex_destroy(&sched->lock);
+	close(sched->efd);
+	free(sched);
+}
+
+int eeprom93_submit(struct eeprom93_sched *sched, struct eeprom93_job *job)
+{
+	struct lib_bus *bus;
+
+	if (!job->handle)
+		return -EINVAL;
+
+	errno = 0;
+	pthread_mutex_lock(&sched->lock);
+	bus = lib_bus_get(sched, job->handle->path);
+	pthread_mutex_unlock(&sched->lock);
+
+	if (!bus)
+		return lib_error();
+
+	bus_queue_submit(&bus->queue, job);
+	return 0;
+}
+
+int eeprom93_sched_fd(const struct eeprom93_sched *sched)
+{
+	return sched->efd;
+}
+
+struct eeprom93_job *eeprom93_reap(struct eeprom93_sched *sched)
+{
+	struct eeprom93_job *job;
+	uint64_t count;
+
+	pthread_mutex_lock(&sched->lock);
+	job = sched->head;
+	if (job) {
+		sched->head = job->next;
+		if (!sched->head) {
+			sched->tail = NULL;
+			/* Nothing left, so stop polling readable. */
+			if (read(sched->efd, &count, sizeof(count)) < 0)
+				count = 0;
+		}
+		job->next = NULL;
+	}
+	pthread_mutex_unlock(&sched->lock);
+
+	return job;
+}
@@ -0,0 +1,132 @@
+/*
+ * libeeprom93cx6 - 93Cxx serial EEPROM access over spidev, as a library
+ *
+ * Copyright (C) 2016 Alexandru Gagniuc <mr.nuke.me@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef LIBEEPROM93CX6_H
+#define LIBEEPROM93CX6_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * An EEPROM attached to a spidev, or to the simulator ("sim[:<file>]").
+ * Handles are independent of each other, but a handle must not be used by
+ * several threads at once.
+ */
+struct eeprom93;
+
+/*
+ * All functions returning int return 0 on success, or a negative errno value:
+ *   -EINVAL     bad arguments, unknown type, or misaligned range
+ *   -ENOMEM     the handle could not be allocated
+ *   -ETIMEDOUT  a write or erase cycle did not complete in time
+ *   -EBADMSG    the EEPROM does not hold the expected contents (verify)
+ *   others      from opening or talking to the spidev
+ */
+
+/* Open 'device' with the geometry of a known part, such as "93c66". */
+int eeprom93_open(struct eeprom93 **handle, const char *device,
+		  const char *type, int x16);
+
+/* Open 'device' with a custom geometry: size in bytes, and address bits. */
+int eeprom93_open_geometry(struct eeprom93 **handle, const char *device,
+			   size_t size, unsigned int addr_bits, int x16);
+
+void eeprom93_close(struct eeprom93 *handle);
+
+/* SPI clock for all following transactions. Defaults to 100 kHz. */
+int eeprom93_set_speed(struct eeprom93 *handle, uint32_t speed_hz);
+
+/* Size of the array, and of a word, in bytes. */
+size_t eeprom93_size(const struct eeprom93 *handle);
+size_t eeprom93_word_size(const struct eeprom93 *handle);
+
+/*
+ * Read, write or erase 'len' bytes at byte offset 'offset'. Both must be
+ * multiples of the word size. Buffers belong to the caller, and nothing is
+ * allocated. Writes only program words which differ from 'cur', when given,
+ * which then holds the current contents of the same range.
+ */
+int eeprom93_read(struct eeprom93 *handle, size_t offset, void *buf,
+		  size_t len);
+int eeprom93_write(struct eeprom93 *handle, size_t offset, const void *buf,
+		   size_t len, const void *cur);
+int eeprom93_erase(struct eeprom93 *handle, size_t offset, size_t len);
+
+/* Compare 'len' bytes at 'offset' with 'buf'. */
+int eeprom93_verify(struct eeprom93 *handle, size_t offset, const void *buf,
+		    size_t len);
+
+/* Set every word to 'word' (WRAL), or erase the whole array (ERAL). */
+int eeprom93_write_all(struct eeprom93 *handle, uint16_t word);
+int eeprom93_erase_all(struct eeprom93 *handle);
+
+/*
+ * Asynchronous jobs. A scheduler runs one worker thread per SPI controller,
+ * so jobs on devices of different controllers overlap, while jobs on the same
+ * controller run in the order they were submitted. Once a handle has jobs
+ * submitted, it must not be used directly until they complete.
+ */
+struct eeprom93_sched;
+
+enum eeprom93_op {
+	EEPROM93_READ,		/* into 'buf' */
+	EEPROM93_WRITE,		/* from 'buf', skipping words equal in 'cur' */
+	EEPROM93_VERIFY,	/* against 'buf' */
+	EEPROM93_ERASE,
+};
+
+/*
+ * A job, and its buffers, belong to the caller, and must stay valid until it
+ * completes. When 'done' is set, it is called on completion, from the worker
+ * thread. Otherwise, the completed job is queued for eeprom93_reap().
+ */
+struct eeprom93_job {
+	enum eeprom93_op op;
+	struct eeprom93 *handle;
+	size_t offset;
+	size_t len;
+	void *buf;
+	const void *cur;
+	void (*done)(struct eeprom93_job *job);
+	void *arg;
+	/* Return value of the operation, set on completion. */
+	int result;
+	/* Private to the library. */
+	void *next;
+};
+
+int eeprom93_sched_create(struct eeprom93_sched **sched);
+
+/* Run the jobs still queued, then stop the workers. */
+void eeprom93_sched_destroy(struct eeprom93_sched *sched);
+
+int eeprom93_submit(struct eeprom93_sched *sched, struct eeprom93_job *job);
+
+/*
+ * An eventfd, which polls readable while completed jobs are waiting to be
+ * reaped. It is owned by the scheduler, and need not be read by the caller.
+ * Once it polls readable, call eeprom93_reap() until it returns NULL. If the
+ * caller reads it too, that must come before reaping.
+ */
+int eeprom93_sched_fd(const struct eeprom93_sched *sched);
+
+/* Take a completed job off the queue, or return NULL if there is none. */
+struct eeprom93_job *eeprom93_reap(struct eeprom93_sched *sched);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBEEPROM93CX6_H */